@@ -0,0 +1,112 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NoesisGUI - http://www.noesisengine.com
+// Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// In-process transport, used when mp.cpp is built into libMediaPlayer with MP_IN_PROCESS. The
+// player runs on its own thread and commands and frames are handed over through two mutex
+// protected rings instead of Unix sockets. Stream reads call readFn/seekFn directly.
+
+#include <pthread.h>
+#include <errno.h>
+
+typedef unsigned int (*ReadStream)(const void* streamPtr, void* buffer, unsigned int size);
+typedef unsigned int (*SeekStream)(const void* streamPtr, unsigned int offset);
+typedef unsigned int (*ReadStreamAt)(void* host, uint32_t index, uint64_t offset, void* buffer, unsigned int size);
+
+static const uint32_t MaxQueuedCommands = 256;
+
+struct CommandQueue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    MediaPlayerCommand commands[MaxQueuedCommands];
+    int fds[MaxQueuedCommands];
+    uint32_t first;
+    uint32_t last;
+};
+
+struct EmbeddedChannel
+{
+    CommandQueue toHost;
+    CommandQueue toPlayer;
+    ReadStream readFn;
+    SeekStream seekFn;
+    const void* const* streams;
+    uint64_t* streamPositions;
+    pthread_mutex_t* streamMutex;
+    uint32_t maxStreams;
+    ReadStreamAt readAtFn; // Set when reads go through libMediaPlayer's I/O scheduler
+    void* host;
+    int traceId;
+    ThreadScheduling scheduling;
+};
+
+static inline void InitQueue(CommandQueue* queue)
+{
+    pthread_mutex_init(&queue->mutex, nullptr);
+    pthread_cond_init(&queue->cond, nullptr);
+    queue->first = 0;
+    queue->last = 0;
+}
+
+static inline void DestroyQueue(CommandQueue* queue)
+{
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+// Returns false and drops the command when the ring is full, like a datagram socket would
+static inline bool PushCommand(CommandQueue* queue, const MediaPlayerCommand* command, int fd)
+{
+    pthread_mutex_lock(&queue->mutex);
+    uint32_t next = (queue->last + 1) % MaxQueuedCommands;
+    bool pushed = next != queue->first;
+    if (pushed)
+    {
+        queue->commands[queue->last] = *command;
+        queue->fds[queue->last] = fd;
+        queue->last = next;
+        pthread_cond_signal(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pushed;
+}
+
+static inline bool PopCommand(CommandQueue* queue, MediaPlayerCommand* command, int* fd)
+{
+    pthread_mutex_lock(&queue->mutex);
+    bool popped = queue->first != queue->last;
+    if (popped)
+    {
+        *command = queue->commands[queue->first];
+        if (fd != nullptr)
+            *fd = queue->fds[queue->first];
+        queue->first = (queue->first + 1) % MaxQueuedCommands;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return popped;
+}
+
+// Waits until the ring is not empty or the timeout expires
+static inline void WaitCommand(CommandQueue* queue, uint32_t timeoutMs)
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    deadline.tv_sec += timeoutMs / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->first == queue->last)
+    {
+        if (pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Implemented in mp.cpp. Starts the player thread, which prerolls the stream and posts the same
+// commands mp would send over its sockets
+void* StartEmbeddedPlayer(EmbeddedChannel* channel, int64_t streamSize, const char* streamName);
+void StopEmbeddedPlayer(void* player);
@@ -3,19 +3,48 @@
 // Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#include <time.h>
+
 static const uint32_t MPC_MediaLoaded = 0;
 static const uint32_t MPC_MediaFailed = 0xffffffff;
 static const uint32_t MPC_MediaEnded = 1;
 static const uint32_t MPC_NewFrame = 2;
-static const uint32_t MPC_Play = 3;
-static const uint32_t MPC_Pause = 4;
+static const uint32_t MPC_Play = 3;  // With a shared clock, may carry the clock time to start at
+static const uint32_t MPC_Pause = 4; // With a shared clock, may carry the clock time to pause at
 static const uint32_t MPC_Stop = 5;
-static const uint32_t MPC_Seek = 6;
+static const uint32_t MPC_Seek = 6;  // With a shared clock, may carry the clock time to restart at
 static const uint32_t MPC_Volume = 7;
-static const uint32_t MPC_FrameAck = 8;
+static const uint32_t MPC_FrameAck = 8; // May carry the fence fd of the draw
+static const uint32_t MPC_StreamChannel = 9;
+static const uint32_t MPC_Queue = 10;
+static const uint32_t MPC_MediaChanged = 11;
+static const uint32_t MPC_Loop = 12;
+static const uint32_t MPC_Quit = 13; // In-process only, stops the player thread
+static const uint32_t MPC_Keyframe = 14;
+static const uint32_t MPC_IndexReady = 15;
+static const uint32_t MPC_SeekCost = 16;
+static const uint32_t MPC_Quality = 17;
+static const uint32_t MPC_Buffering = 18;
+static const uint32_t MPC_Latency = 19;
+static const uint32_t MPC_VisibleRect = 20;
+static const uint32_t MPC_Suspend = 21; // Releases the decoder, keeps the position and play state
+static const uint32_t MPC_Resume = 22;
+static const uint32_t MPC_SyncClock = 23; // Slaves the pipeline to CLOCK_MONOTONIC, shared by every player
+
+// MPC_NewFrame flags
+static const uint32_t MPF_SharedMemory = 1; // fd is a memfd holding tightly packed NV12, not a dmabuf
     
 struct MediaPlayerCommand
 {
     uint32_t cmd;
+    uint32_t flags; // MPF_* of MPC_NewFrame, zeroed by SendCommand for everything else
     uint64_t arg[2];
+    uint64_t stamp; // CLOCK_MONOTONIC ns at send time
 };
+
+static inline uint64_t MonotonicTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
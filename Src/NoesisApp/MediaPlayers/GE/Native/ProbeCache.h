@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NoesisGUI - http://www.noesisengine.com
+// Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Persistent probe results for media that is opened over and over. Enabled when MP_PROBE_CACHE
+// names a file. Entries are keyed by stream name, size and a hash of the first bytes so a changed
+// asset never matches a stale entry. The file is a fixed table of entries, shared between mp
+// processes under flock, and the least recently used entry is replaced when it is full.
+
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t MaxProbeEntries = 64;
+static const uint32_t ProbeHashSize = 64 * 1024;
+static const char ProbeMagic[8] = { 'M', 'P', 'P', 'R', 'O', 'B', 'E', '1' };
+
+struct ProbeEntry
+{
+    uint64_t key;
+    uint64_t lastUsed;
+    uint64_t duration;
+    uint64_t dimensions;
+    char container[128]; // Caps found by typefind, set on appsrc to skip typefinding
+    char demuxer[32];    // Factory names chosen by autoplugging
+    char parser[32];
+    char decoder[32];
+    char caps[256];      // Decoded video caps
+};
+
+static inline uint64_t ProbeHash(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static inline uint64_t ProbeKey(const char* name, int64_t size, const uint8_t* data, size_t dataSize)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = ProbeHash(hash, name, strlen(name));
+    hash = ProbeHash(hash, &size, sizeof(size));
+    hash = ProbeHash(hash, data, dataSize);
+    return hash != 0 ? hash : 1;
+}
+
+static inline bool ProbeCacheEnabled()
+{
+    return getenv("MP_PROBE_CACHE") != NULL;
+}
+
+// Opens and locks the table, creating it when missing or when the format changed
+static inline int ProbeOpen()
+{
+    const char* path = getenv("MP_PROBE_CACHE");
+    if (path == NULL)
+        return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    flock(fd, LOCK_EX);
+
+    char magic[sizeof(ProbeMagic)];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, ProbeMagic, sizeof(magic)) != 0)
+    {
+        ProbeEntry empty;
+        memset(&empty, 0, sizeof(ProbeEntry));
+        pwrite(fd, ProbeMagic, sizeof(ProbeMagic), 0);
+        for (uint32_t i = 0; i < MaxProbeEntries; i++)
+            pwrite(fd, &empty, sizeof(ProbeEntry), sizeof(ProbeMagic) + i * sizeof(ProbeEntry));
+    }
+
+    return fd;
+}
+
+static inline void ProbeClose(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static inline off_t ProbeOffset(uint32_t slot)
+{
+    return sizeof(ProbeMagic) + slot * sizeof(ProbeEntry);
+}
+
+static inline bool ProbeLookup(uint64_t key, ProbeEntry* entry)
+{
+    int fd = ProbeOpen();
+    if (fd == -1)
+        return false;
+
+    bool found = false;
+    for (uint32_t i = 0; i < MaxProbeEntries && !found; i++)
+    {
+        if (pread(fd, entry, sizeof(ProbeEntry), ProbeOffset(i)) == sizeof(ProbeEntry) && entry->key == key)
+        {
+            entry->lastUsed = (uint64_t)time(NULL);
+            pwrite(fd, &entry->lastUsed, sizeof(uint64_t), ProbeOffset(i) + sizeof(uint64_t));
+            found = true;
+        }
+    }
+
+    ProbeClose(fd);
+    return found;
+}
+
+// Replaces the entry with the same key, or else an empty or the least recently used one
+static inline void ProbeStore(ProbeEntry* entry)
+{
+    int fd = ProbeOpen();
+    if (fd == -1)
+        return;
+
+    uint32_t slot = 0;
+    uint64_t oldest = UINT64_MAX;
+    for (uint32_t i = 0; i < MaxProbeEntries; i++)
+    {
+        ProbeEntry existing;
+        if (pread(fd, &existing, sizeof(ProbeEntry), ProbeOffset(i)) != sizeof(ProbeEntry))
+            continue;
+
+        if (existing.key == entry->key)
+        {
+            slot = i;
+            break;
+        }
+
+        uint64_t used = existing.key == 0 ? 0 : existing.lastUsed;
+        if (used < oldest)
+        {
+            oldest = used;
+            slot = i;
+        }
+    }
+
+    entry->lastUsed = (uint64_t)time(NULL);
+    pwrite(fd, entry, sizeof(ProbeEntry), ProbeOffset(slot));
+    ProbeClose(fd);
+}
+
+static inline void ProbeRemove(uint64_t key)
+{
+    int fd = ProbeOpen();
+    if (fd == -1)
+        return;
+
+    for (uint32_t i = 0; i < MaxProbeEntries; i++)
+    {
+        uint64_t existing;
+        if (pread(fd, &existing, sizeof(uint64_t), ProbeOffset(i)) == sizeof(uint64_t) && existing == key)
+        {
+            ProbeEntry empty;
+            memset(&empty, 0, sizeof(ProbeEntry));
+            pwrite(fd, &empty, sizeof(ProbeEntry), ProbeOffset(i));
+        }
+    }
+
+    ProbeClose(fd);
+}
@@ -0,0 +1,66 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NoesisGUI - http://www.noesisengine.com
+// Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// CPU placement for the video threads: mp, its GStreamer streaming threads and the stream reader
+// threads of libMediaPlayer. Keeping them off the core the UI renders on avoids both sides missing
+// their deadlines. Defaults come from MP_VIDEO_CPUS (mask, e.g. 0xe for cores 1-3),
+// MP_VIDEO_POLICY (a SCHED_* value) and MP_VIDEO_PRIORITY (nice value, or the real-time priority
+// for SCHED_FIFO and SCHED_RR). Affinity, policy and nice are inherited by new threads and by mp
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+static const int32_t InheritPolicy = -1;
+
+struct ThreadScheduling
+{
+    uint64_t cpuMask; // 0 keeps the inherited affinity
+    int32_t policy;   // InheritPolicy keeps the inherited policy and priority
+    int32_t priority;
+};
+
+static inline void InitScheduling(ThreadScheduling* scheduling)
+{
+    const char* cpus = getenv("MP_VIDEO_CPUS");
+    const char* policy = getenv("MP_VIDEO_POLICY");
+    const char* priority = getenv("MP_VIDEO_PRIORITY");
+
+    scheduling->cpuMask = cpus != NULL ? strtoull(cpus, NULL, 0) : 0;
+    scheduling->policy = policy != NULL ? atoi(policy) : InheritPolicy;
+    scheduling->priority = priority != NULL ? atoi(priority) : 0;
+}
+
+// Applies to the calling thread only. Failures, like missing CAP_SYS_NICE for real-time policies,
+// leave the thread as it was
+static inline void ApplyScheduling(const ThreadScheduling* scheduling)
+{
+    if (scheduling->cpuMask != 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (uint32_t cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (scheduling->cpuMask & (1ull << cpu))
+                CPU_SET(cpu, &set);
+        }
+        sched_setaffinity(0, sizeof(cpu_set_t), &set);
+    }
+
+    if (scheduling->policy != InheritPolicy)
+    {
+        bool realTime = scheduling->policy == SCHED_FIFO || scheduling->policy == SCHED_RR;
+
+        sched_param param;
+        param.sched_priority = realTime ? scheduling->priority : 0;
+        sched_setscheduler(0, scheduling->policy, &param);
+
+        // On Linux nice is per thread when given a thread id
+        if (!realTime)
+            setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), scheduling->priority);
+    }
+}
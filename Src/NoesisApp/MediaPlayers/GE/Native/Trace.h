@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NoesisGUI - http://www.noesisengine.com
+// Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Opt-in frame tracing. When MP_TRACE names a file, libMediaPlayer creates it and every mp it
+// spawns appends to it, producing a single Chrome/Perfetto trace in JSON array format (the
+// closing bracket is optional). Each event is one O_APPEND write so nothing is lost when mp is
+// killed. Frame events carry the PTS and are linked across processes with flow events.
+
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int TraceFd = -1;
+
+static inline void TraceOpen(bool create)
+{
+    const char* path = getenv("MP_TRACE");
+    if (path == NULL || TraceFd != -1)
+        return;
+
+    if (create)
+    {
+        TraceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (TraceFd != -1)
+            write(TraceFd, "[\n", 2);
+    }
+    else
+    {
+        TraceFd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+}
+
+static inline bool TraceEnabled()
+{
+    return TraceFd != -1;
+}
+
+static inline void TraceWrite(const char* name, char phase, uint64_t start, uint64_t end, int owner,
+    const char* argName, uint64_t arg)
+{
+    char event[512];
+    int len;
+    if (phase == 'X')
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"mp\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"mp\":%d,\"%s\":%llu}},\n", name, start * 1e-3,
+            (end - start) * 1e-3, getpid(), (int)syscall(SYS_gettid), owner, argName, (unsigned long long)arg);
+    }
+    else if (phase == 's' || phase == 'f')
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"%c\",%s\"id\":\"%d-%llu\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d},\n", name, phase, phase == 'f' ? "\"bp\":\"e\"," : "", owner,
+            (unsigned long long)arg, start * 1e-3, getpid(), (int)syscall(SYS_gettid));
+    }
+    else
+    {
+        len = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"mp\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"mp\":%d,\"%s\":%llu}},\n", name, start * 1e-3, getpid(),
+            (int)syscall(SYS_gettid), owner, argName, (unsigned long long)arg);
+    }
+
+    write(TraceFd, event, len);
+}
+
+// Complete event from start until now
+static inline void TraceSpan(const char* name, uint64_t start, int owner, const char* argName, uint64_t arg)
+{
+    if (TraceFd != -1)
+        TraceWrite(name, 'X', start, MonotonicTime(), owner, argName, arg);
+}
+
+static inline void TraceInstant(const char* name, int owner, const char* argName, uint64_t arg)
+{
+    if (TraceFd != -1)
+        TraceWrite(name, 'i', MonotonicTime(), 0, owner, argName, arg);
+}
+
+// Flow start ('s') or end ('f') for the frame with the given PTS, binds to the enclosing span
+static inline void TraceFlow(char phase, uint64_t time, int owner, uint64_t pts)
+{
+    if (TraceFd != -1)
+        TraceWrite("frame", phase, time, 0, owner, "pts", pts);
+}
@@ -0,0 +1,577 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NoesisGUI - http://www.noesisengine.com
+// Copyright (c) 2013 Noesis Technologies S.L. All Rights Reserved.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Headless benchmark for libMediaPlayer + mp. Drives the exported C API on a surfaceless EGL
+// context and prints one JSON object per clip. Must be run from the directory containing mp.
+//
+//   bench [-t seconds] [-s seeks] clip...
+//
+// With -n it runs a soak instead: for each player count in the list, that many players cycle
+// through the clips for -t seconds while random seek, stop, loop and destroy operations are
+// applied. Resource usage is printed as one JSON object every -i seconds and once at the end.
+//
+//   bench -n 1,4,16,32 [-t seconds] [-i interval] [-r seed] clip...
+//
+// build_arm.sh cross-builds it for the device. MP_HOST_BENCH=1 ./build_arm.sh also builds mp,
+// libMediaPlayer and bench for the host into bin/host, to run on Mesa's surfaceless platform with
+// llvmpipe (LIBGL_ALWAYS_SOFTWARE=1).
+
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <dirent.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "MediaPlayerCommand.h"
+
+typedef unsigned int (*ReadStream)(const void* streamPtr, void* buffer, unsigned int size);
+typedef unsigned int (*SeekStream)(const void* streamPtr, unsigned int offset);
+
+typedef unsigned int (*MediaOpened)();
+typedef unsigned int (*MediaEnded)();
+typedef unsigned int (*MediaFailed)();
+
+extern "C" void InitMediaPlayer();
+extern "C" void* CreateState();
+extern "C" void DestroyState(void* state);
+extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* streamName, int64_t streamSize,
+    ReadStream readFn, SeekStream seekFn, MediaOpened mediaOpenedFn, MediaEnded mediaEndedFn, MediaFailed mediaFailedFn);
+extern "C" uint32_t GetWidth(void* state);
+extern "C" uint32_t GetHeight(void* state);
+extern "C" double GetDuration(void* state);
+extern "C" double GetTime(void* state);
+extern "C" double GetFrameLatency(void* state);
+extern "C" void Play(void* state);
+extern "C" void Stop(void* state);
+extern "C" void Seek(void* state, double position);
+extern "C" void SetIsLooping(void* state, bool isLooping);
+extern "C" uint32_t GetLiveImageCount();
+extern "C" bool HasNewFrame(void* state);
+extern "C" void RenderFrame(void* state);
+extern "C" bool IsValid(void* state);
+extern "C" bool Update(void* state);
+
+static const uint64_t Timeout = 10000000000ull;
+
+static bool Ended;
+static bool Failed;
+
+static unsigned int FileRead(const void* streamPtr, void* buffer, unsigned int size)
+{
+    return (unsigned int)fread(buffer, 1, size, (FILE*)streamPtr);
+}
+
+static unsigned int FileSeek(const void* streamPtr, unsigned int offset)
+{
+    fseek((FILE*)streamPtr, offset, SEEK_SET);
+    return (unsigned int)ftell((FILE*)streamPtr);
+}
+
+static unsigned int OnOpened() { return 0; }
+static unsigned int OnEnded() { Ended = true; return 0; }
+static unsigned int OnFailed() { Failed = true; return 0; }
+
+static uint64_t CpuTime(int who)
+{
+    rusage usage;
+    getrusage(who, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+        (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+static bool CreateContext()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC GetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (GetPlatformDisplayEXT == 0)
+        return false;
+
+    EGLDisplay display = GetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+        return false;
+
+    eglBindAPI(EGL_OPENGL_ES_API);
+    EGLint attribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+    if (context == EGL_NO_CONTEXT)
+        return false;
+
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+static void BindRenderTarget(uint32_t width, uint32_t height, GLuint* texture, GLuint* fbo)
+{
+    glGenTextures(1, texture);
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *texture, 0);
+    glViewport(0, 0, width, height);
+}
+
+// Pumps events and draws any pending frame, returns true if a frame was drawn
+static bool Pump(void* st)
+{
+    Update(st);
+    if (HasNewFrame(st))
+    {
+        RenderFrame(st);
+        return true;
+    }
+
+    usleep(500);
+    return false;
+}
+
+static void RunClip(const char* path, double seconds, int seeks)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("{\"clip\":\"%s\",\"error\":\"open\"}\n", path);
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    int64_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    Ended = false;
+    Failed = false;
+
+    uint64_t cpuSelf = CpuTime(RUSAGE_SELF);
+    uint64_t cpuChildren = CpuTime(RUSAGE_CHILDREN);
+
+    uint64_t openStart = MonotonicTime();
+    void* st = CreateState();
+    OpenMedia(st, file, path, size, FileRead, FileSeek, OnOpened, OnEnded, OnFailed);
+
+    while (!IsValid(st) && !Failed && MonotonicTime() - openStart < Timeout)
+        Pump(st);
+
+    uint64_t loaded = MonotonicTime();
+    if (!IsValid(st))
+    {
+        DestroyState(st);
+        fclose(file);
+        printf("{\"clip\":\"%s\",\"error\":\"%s\"}\n", path, Failed ? "failed" : "timeout");
+        return;
+    }
+
+    uint32_t width = GetWidth(st);
+    uint32_t height = GetHeight(st);
+    GLuint texture, fbo;
+    BindRenderTarget(width, height, &texture, &fbo);
+
+    Play(st);
+    while (!Pump(st) && !Failed && MonotonicTime() - loaded < Timeout);
+    uint64_t firstFrame = MonotonicTime();
+
+    // Sustained playback
+    uint32_t frames = 0;
+    double latencySum = 0.0;
+    double latencyMax = 0.0;
+    uint64_t playStart = MonotonicTime();
+    uint64_t playEnd = playStart + (uint64_t)(seconds * 1e9);
+    while (!Ended && !Failed && MonotonicTime() < playEnd)
+    {
+        if (Pump(st))
+        {
+            double latency = GetFrameLatency(st);
+            latencySum += latency;
+            latencyMax = latency > latencyMax ? latency : latencyMax;
+            frames++;
+        }
+    }
+    double playTime = (MonotonicTime() - playStart) * 1e-9;
+
+    // Random accurate seeks, measured until a frame at the target position is drawn
+    double duration = GetDuration(st);
+    double seekSum = 0.0;
+    double seekMax = 0.0;
+    int seekCount = 0;
+    srand(1);
+    for (int i = 0; i < seeks && !Failed; i++)
+    {
+        double position = duration * 0.9 * rand() / RAND_MAX;
+        uint64_t seekStart = MonotonicTime();
+        Seek(st, position);
+        while (!Failed && MonotonicTime() - seekStart < Timeout)
+        {
+            if (Pump(st) && GetTime(st) >= position - 0.1 && GetTime(st) <= position + 0.5)
+            {
+                double latency = (MonotonicTime() - seekStart) * 1e-9;
+                seekSum += latency;
+                seekMax = latency > seekMax ? latency : seekMax;
+                seekCount++;
+                break;
+            }
+        }
+    }
+
+    DestroyState(st);
+    fclose(file);
+
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+
+    // mp is reaped by DestroyState so its CPU time is now accounted in RUSAGE_CHILDREN
+    double wallTime = (MonotonicTime() - openStart) * 1e-9;
+    double cpuHost = (CpuTime(RUSAGE_SELF) - cpuSelf) * 1e-9;
+    double cpuMp = (CpuTime(RUSAGE_CHILDREN) - cpuChildren) * 1e-9;
+
+    printf("{\"clip\":\"%s\",\"width\":%u,\"height\":%u,\"duration\":%.3f,"
+        "\"open_to_loaded\":%.6f,\"open_to_first_frame\":%.6f,"
+        "\"frames\":%u,\"fps\":%.2f,\"ipc_latency_avg\":%.6f,\"ipc_latency_max\":%.6f,"
+        "\"seeks\":%d,\"seek_latency_avg\":%.6f,\"seek_latency_max\":%.6f,"
+        "\"cpu_host\":%.3f,\"cpu_mp\":%.3f,\"cpu_usage\":%.3f,\"failed\":%s}\n",
+        path, width, height, duration,
+        (loaded - openStart) * 1e-9, (firstFrame - openStart) * 1e-9,
+        frames, frames / playTime, frames ? latencySum / frames : 0.0, latencyMax,
+        seekCount, seekCount ? seekSum / seekCount : 0.0, seekMax,
+        cpuHost, cpuMp, (cpuHost + cpuMp) / wallTime, Failed ? "true" : "false");
+    fflush(stdout);
+}
+
+struct SoakPlayer
+{
+    void* st;
+    FILE* file;
+    const char* clip;
+    uint64_t openTime;
+    uint64_t nextOp;
+    uint32_t frames;
+    bool looping;
+};
+
+struct SoakUsage
+{
+    uint32_t fds;
+    uint32_t threads;
+    uint32_t images;
+    uint64_t rss;
+    uint32_t children;
+    uint64_t childrenRss;
+    uint32_t tmpDirs;
+};
+
+static uint32_t CountEntries(const char* path, const char* prefix, size_t length)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+
+    uint32_t count = 0;
+    while (dirent* entry = readdir(dir))
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (prefix == NULL || (strncmp(entry->d_name, prefix, strlen(prefix)) == 0 && strlen(entry->d_name) == length))
+            count++;
+    }
+
+    closedir(dir);
+    return count;
+}
+
+// Resident set size in KB of a /proc/<pid>/stat, or 0 if it is not a child mp
+static uint64_t ChildRss(const char* pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+
+    char line[1024];
+    size_t size = fread(line, 1, sizeof(line) - 1, file);
+    line[size] = 0;
+    fclose(file);
+
+    // Fields after the command name: state ppid ... rss is the 22nd
+    char* fields = strrchr(line, ')');
+    if (fields == NULL || strstr(line, "(mp)") == NULL)
+        return 0;
+
+    int ppid = 0;
+    long rss = 0;
+    sscanf(fields + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+        &ppid, &rss);
+    return ppid == getpid() ? (uint64_t)rss * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+static void MeasureUsage(SoakUsage* usage)
+{
+    // opendir holds one fd of its own
+    usage->fds = CountEntries("/proc/self/fd", NULL, 0) - 1;
+    usage->threads = CountEntries("/proc/self/task", NULL, 0);
+    usage->images = GetLiveImageCount();
+    usage->tmpDirs = CountEntries("/tmp", "mp", 8);
+
+    long size = 0;
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL)
+    {
+        fscanf(statm, "%ld %ld", &size, &pages);
+        fclose(statm);
+    }
+    usage->rss = (uint64_t)pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+    usage->children = 0;
+    usage->childrenRss = 0;
+    DIR* proc = opendir("/proc");
+    if (proc != NULL)
+    {
+        while (dirent* entry = readdir(proc))
+        {
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+                continue;
+            uint64_t rss = ChildRss(entry->d_name);
+            if (rss != 0)
+            {
+                usage->children++;
+                usage->childrenRss += rss;
+            }
+        }
+        closedir(proc);
+    }
+}
+
+static bool OpenSoakPlayer(SoakPlayer* player, const char* clip)
+{
+    player->clip = clip;
+    player->file = fopen(clip, "rb");
+    if (player->file == NULL)
+        return false;
+
+    fseek(player->file, 0, SEEK_END);
+    int64_t size = ftell(player->file);
+    fseek(player->file, 0, SEEK_SET);
+
+    player->st = CreateState();
+    OpenMedia(player->st, player->file, clip, size, FileRead, FileSeek, OnOpened, OnEnded, OnFailed);
+    player->openTime = MonotonicTime();
+    player->frames = 0;
+    player->looping = false;
+    Play(player->st);
+    return true;
+}
+
+static void CloseSoakPlayer(SoakPlayer* player)
+{
+    DestroyState(player->st);
+    fclose(player->file);
+    player->st = NULL;
+    player->file = NULL;
+}
+
+static void PrintUsage(const char* phase, uint32_t count, double elapsed, const SoakUsage& usage,
+    const SoakPlayer* players, uint32_t ops, uint32_t reopens, uint32_t failures)
+{
+    printf("{\"phase\":\"%s\",\"players\":%u,\"time\":%.1f,\"fds\":%u,\"threads\":%u,\"egl_images\":%u,"
+        "\"rss_kb\":%lu,\"mp_children\":%u,\"mp_rss_kb\":%lu,\"tmp_dirs\":%u,"
+        "\"ops\":%u,\"reopens\":%u,\"failures\":%u,\"fps\":[",
+        phase, count, elapsed, usage.fds, usage.threads, usage.images,
+        (unsigned long)usage.rss, usage.children, (unsigned long)usage.childrenRss, usage.tmpDirs,
+        ops, reopens, failures);
+
+    uint64_t now = MonotonicTime();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const SoakPlayer& player = players[i];
+        double time = (now - player.openTime) * 1e-9;
+        printf("%s%.1f", i == 0 ? "" : ",", player.st != NULL && time > 0.0 ? player.frames / time : 0.0);
+    }
+
+    printf("]}\n");
+    fflush(stdout);
+}
+
+// Every player gets a random operation every 1 to 5 seconds. Destroyed or failed players are
+// reopened with the next clip, so the player count stays constant
+static void RunSoak(uint32_t count, char** clips, int clipCount, double seconds, double interval, unsigned int seed)
+{
+    srand(seed);
+
+    GLuint texture, fbo;
+    BindRenderTarget(256, 256, &texture, &fbo);
+
+    SoakUsage baseline;
+    MeasureUsage(&baseline);
+    PrintUsage("baseline", 0, 0.0, baseline, NULL, 0, 0, 0);
+
+    SoakPlayer* players = new SoakPlayer[count];
+    memset(players, 0, count * sizeof(SoakPlayer));
+
+    uint32_t ops = 0;
+    uint32_t reopens = 0;
+    uint32_t failures = 0;
+    int nextClip = 0;
+
+    uint64_t start = MonotonicTime();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!OpenSoakPlayer(&players[i], clips[nextClip++ % clipCount]))
+            failures++;
+        players[i].nextOp = start + (1000 + rand() % 4000) * 1000000ull;
+    }
+
+    uint64_t end = start + (uint64_t)(seconds * 1e9);
+    uint64_t nextSample = start + (uint64_t)(interval * 1e9);
+    while (MonotonicTime() < end)
+    {
+        bool drawn = false;
+        uint64_t now = MonotonicTime();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            SoakPlayer& player = players[i];
+            // Update only returns false once the media failed
+            if (player.st == NULL || !Update(player.st) || (!IsValid(player.st) && now - player.openTime > Timeout))
+            {
+                if (player.st != NULL)
+                {
+                    CloseSoakPlayer(&player);
+                    failures++;
+                }
+                if (!OpenSoakPlayer(&player, clips[nextClip++ % clipCount]))
+                    failures++;
+                reopens++;
+                continue;
+            }
+
+            if (HasNewFrame(player.st))
+            {
+                RenderFrame(player.st);
+                player.frames++;
+                drawn = true;
+            }
+
+            if (now >= player.nextOp && IsValid(player.st))
+            {
+                int op = rand() % 4;
+                if (op == 0)
+                {
+                    Seek(player.st, GetDuration(player.st) * 0.9 * rand() / RAND_MAX);
+                }
+                else if (op == 1)
+                {
+                    Stop(player.st);
+                    Play(player.st);
+                }
+                else if (op == 2)
+                {
+                    player.looping = !player.looping;
+                    SetIsLooping(player.st, player.looping);
+                }
+                else
+                {
+                    CloseSoakPlayer(&player);
+                    if (!OpenSoakPlayer(&player, clips[nextClip++ % clipCount]))
+                        failures++;
+                    reopens++;
+                }
+
+                ops++;
+                player.nextOp = now + (1000 + rand() % 4000) * 1000000ull;
+            }
+        }
+
+        if (now >= nextSample)
+        {
+            SoakUsage usage;
+            MeasureUsage(&usage);
+            PrintUsage("running", count, (now - start) * 1e-9, usage, players, ops, reopens, failures);
+            nextSample += (uint64_t)(interval * 1e9);
+        }
+
+        if (!drawn)
+            usleep(1000);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (players[i].st != NULL)
+            CloseSoakPlayer(&players[i]);
+    }
+
+    // Everything above the baseline after every player is destroyed is a leak
+    SoakUsage usage;
+    MeasureUsage(&usage);
+    PrintUsage("destroyed", count, (MonotonicTime() - start) * 1e-9, usage, players, ops, reopens, failures);
+
+    delete[] players;
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = 10.0;
+    double interval = 10.0;
+    int seeks = 10;
+    unsigned int seed = 1;
+    const char* soakCounts = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:n:i:r:")) != -1)
+    {
+        if (opt == 't')
+            seconds = atof(optarg);
+        else if (opt == 's')
+            seeks = atoi(optarg);
+        else if (opt == 'n')
+            soakCounts = optarg;
+        else if (opt == 'i')
+            interval = atof(optarg);
+        else if (opt == 'r')
+            seed = (unsigned int)atoi(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-t seconds] [-s seeks] clip...\n", argv[0]);
+            fprintf(stderr, "       %s -n 1,4,16,32 [-t seconds] [-i interval] [-r seed] clip...\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (!CreateContext())
+    {
+        fprintf(stderr, "surfaceless EGL context not available\n");
+        return -1;
+    }
+
+    InitMediaPlayer();
+
+    if (soakCounts != NULL)
+    {
+        if (optind == argc)
+            return -1;
+
+        for (const char* count = soakCounts; count != NULL; count = strchr(count, ','))
+        {
+            if (*count == ',')
+                count++;
+            RunSoak((uint32_t)atoi(count), argv + optind, argc - optind, seconds, interval, seed);
+        }
+        return 0;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        RunClip(argv[i], seconds, seeks);
+    }
+
+    return 0;
+}
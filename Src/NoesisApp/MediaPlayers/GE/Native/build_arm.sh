@@ -1,2 +1,15 @@
 arm-linux-gnueabihf-gcc mp.cpp -o ../runtimes/linux-arm/native/mp -g -std=c++11 -fPIC -I. -I/usr/include `pkg-config --cflags --libs gstreamer-1.0 gstreamer-plugins-base-1.0 gstreamer-allocators-1.0 gstreamer-video-1.0 gstreamer-app-1.0` --sysroot /home/pizzi/Noesis/GE/Max10Updater/rootfs
+if [ "$MP_IN_PROCESS" = "1" ]; then
+# Links the pipeline into libMediaPlayer. Players run as threads when MP_IN_PROCESS is set at runtime or SetInProcess is called
+arm-linux-gnueabihf-gcc libGEMediaPlayer.cpp mp.cpp -DMP_IN_PROCESS -o ../runtimes/linux-arm/native/libMediaPlayer.so -g -std=c++11 -fPIC -I. -I/usr/include -lEGL -lGLESv2 `pkg-config --cflags --libs gstreamer-1.0 gstreamer-plugins-base-1.0 gstreamer-allocators-1.0 gstreamer-video-1.0 gstreamer-app-1.0` -shared -pthread --sysroot /home/pizzi/Noesis/GE/Max10Updater/rootfs
+else
 arm-linux-gnueabihf-gcc libGEMediaPlayer.cpp -o ../runtimes/linux-arm/native/libMediaPlayer.so -g -std=c++11 -fPIC -I. -I/usr/include -lEGL -lGLESv2 -shared -pthread --sysroot /home/pizzi/Noesis/GE/Max10Updater/rootfs
+fi
+arm-linux-gnueabihf-gcc bench.cpp -o ../runtimes/linux-arm/native/bench -g -std=c++11 -I. -I/usr/include -L../runtimes/linux-arm/native -lMediaPlayer -lEGL -lGLESv2 -Wl,-rpath,'$ORIGIN' --sysroot /home/pizzi/Noesis/GE/Max10Updater/rootfs
+if [ "$MP_HOST_BENCH" = "1" ]; then
+# Host build of mp, libMediaPlayer and bench for a surfaceless Mesa run, e.g. LIBGL_ALWAYS_SOFTWARE=1 on llvmpipe. Run bench from bin/host so it finds mp
+mkdir -p bin/host
+g++ mp.cpp -o bin/host/mp -g -std=c++11 -fPIC -I. `pkg-config --cflags --libs gstreamer-1.0 gstreamer-plugins-base-1.0 gstreamer-allocators-1.0 gstreamer-video-1.0 gstreamer-app-1.0`
+g++ libGEMediaPlayer.cpp -o bin/host/libMediaPlayer.so -g -std=c++11 -fPIC -I. -lEGL -lGLESv2 -shared -pthread
+g++ bench.cpp -o bin/host/bench -g -std=c++11 -I. -Lbin/host -lMediaPlayer -lEGL -lGLESv2 -Wl,-rpath,'$ORIGIN'
+fi
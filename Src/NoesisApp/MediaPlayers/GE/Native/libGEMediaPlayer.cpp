@@ -15,6 +15,7 @@
 #include <sys/un.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -23,20 +24,26 @@
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include <stdio.h>
+#include <atomic>
 
 #include "MediaPlayerCommand.h"
+#include "Scheduling.h"
+#include "MediaPlayerChannel.h"
+#include "Trace.h"
 
 static const GLchar* VertexShaderSource =
     "#version 100\n"
     "attribute vec4 a_position;\n"
     "attribute vec2 a_tex_coord;\n"
     "varying vec2 v_tex_coord;\n"
+    "uniform vec4 u_tex_rect;\n"
     "void main()\n"
     "{\n"
     "   gl_Position = a_position;\n"
-    "   v_tex_coord = a_tex_coord;\n"
+    "   v_tex_coord = u_tex_rect.xy + a_tex_coord * u_tex_rect.zw;\n"
     "}\n";
 
 static const GLchar* FragmentShaderSource =
@@ -52,6 +59,29 @@ static const GLchar* FragmentShaderSource =
     "    gl_FragColor = vec4(rgb,1);\n"
     "}\n";
 
+static const GLchar* Nv12FragmentShaderSource =
+    "#version 100\n"
+    "precision mediump float;\n"
+    "varying vec2 v_tex_coord;\n"
+    "uniform sampler2D s_y_texture;\n"
+    "uniform sampler2D s_uv_texture;\n"
+    "void main()\n"
+    "{\n"
+    "    float y = 1.164 * (texture2D(s_y_texture, v_tex_coord).r - 0.0625);\n"
+    "    vec2 uv = texture2D(s_uv_texture, v_tex_coord).ra - 0.5;\n"
+    "    gl_FragColor = vec4(y + 1.596 * uv.y, y - 0.391 * uv.x - 0.813 * uv.y, y + 2.018 * uv.x, 1);\n"
+    "}\n";
+
+static const GLchar* RgbaFragmentShaderSource =
+    "#version 100\n"
+    "precision mediump float;\n"
+    "varying vec2 v_tex_coord;\n"
+    "uniform sampler2D s_rgba_texture;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = vec4(texture2D(s_rgba_texture, v_tex_coord).rgb, 1);\n"
+    "}\n";
+
 static const GLchar* BlankFragmentShaderSource =
     "#version 100\n"
     "void main()\n"
@@ -62,22 +92,151 @@ static const GLchar* BlankFragmentShaderSource =
 GLuint mVertexShader;
 GLuint mFragmentShader;
 GLuint mBlankFragmentShader;
+GLuint mNv12FragmentShader;
+GLuint mRgbaFragmentShader;
 GLuint mProgram;
 GLuint mBlankProgram;
+GLuint mNv12Program;
+GLuint mRgbaProgram;
 GLuint mVertexBuffer;
 GLuint mIndexBuffer;
 GLint mYuyvSamplerLocation;
+GLint mYSamplerLocation;
+GLint mUVSamplerLocation;
+GLint mTexRectLocation;
+GLint mNv12TexRectLocation;
+GLint mRgbaSamplerLocation;
+GLint mRgbaTexRectLocation;
 PFNEGLCREATEIMAGEKHRPROC CreateImageKHR = 0;
 PFNEGLDESTROYIMAGEKHRPROC DestroyImageKHR = 0;
 PFNGLEGLIMAGETARGETTEXTURE2DOESPROC EGLImageTargetTexture2DOES = 0;
+PFNEGLCREATESYNCKHRPROC CreateSyncKHR = 0;
+PFNEGLDESTROYSYNCKHRPROC DestroySyncKHR = 0;
+PFNEGLCLIENTWAITSYNCKHRPROC ClientWaitSyncKHR = 0;
+PFNEGLDUPNATIVEFENCEFDANDROIDPROC DupNativeFenceFDANDROID = 0;
+PFNEGLWAITSYNCKHRPROC WaitSyncKHR = 0;
+EGLDisplay mDisplay = EGL_NO_DISPLAY;
+std::atomic<uint32_t> mLiveImages(0);
+
+// Process-wide video memory budget, in bytes. 0 means no budget
+static uint64_t VideoMemoryBudget = 0;
+static uint64_t VideoMemoryUsage = 0;
+static uint64_t BudgetCheckTime = 0;
+
+// Looping clips up to this long and this big are played from textures once decoded, 0 disables
+static uint64_t FrameCacheDuration = 0;
+static uint64_t FrameCacheSize = 64 * 1024 * 1024;
 
-typedef unsigned int (*ReadStream)(const void* streamPtr, void* buffer, unsigned int size);
-typedef unsigned int (*SeekStream)(const void* streamPtr, unsigned int offset);
+// Dmabuf frames are imported as they arrive by a worker with a context shared with the render
+// thread. Running once the first frame is drawn with ImportThread set
+static bool ImportThread = false;
+static std::atomic<bool> ImportRunning(false);
+
+// Every player, so the budget can be checked across all of them. DestroyState may run on a
+// finalizer thread
+static pthread_mutex_t PlayersMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PlayersCond = PTHREAD_COND_INITIALIZER; // A shared decoder finished opening
+static struct GstMediaPlayerState* Players = nullptr;
 
 typedef unsigned int (*MediaOpened)();
 typedef unsigned int (*MediaEnded)();
 typedef unsigned int (*MediaFailed)();
 
+// Streams opened with OpenMedia (index 0) and QueueMedia, indexed modulo MaxStreams
+static const uint32_t MaxStreams = 16;
+
+// Last block the I/O scheduler read from a stream
+struct IoBuffer
+{
+    uint8_t* data;
+    uint32_t capacity;
+    uint64_t offset;
+    uint32_t size;
+};
+
+// Draws whose frame is acked once the GPU finished them, when only EGL_KHR_fence_sync is available
+static const uint32_t MaxPendingFences = 8;
+
+struct PendingFence
+{
+    uint64_t time;
+    EGLSyncKHR sync;
+};
+
+// Readbacks packed into pixel buffers, mapped once their fence signals a frame or two later
+static const uint32_t MaxReadbacks = 3;
+
+// Readback formats, RGB565 falls back to RGBA when the driver can't read it back directly
+static const uint32_t MPR_RGBA = 0;
+static const uint32_t MPR_RGB565 = 1;
+
+struct PendingReadback
+{
+    GLuint buffer;
+    uint32_t capacity;
+    GLsync sync;
+    uint64_t time;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+};
+
+// A looping clip is recorded during one whole loop, drawn at full size into RGBA textures. Once it
+// wraps around mp is suspended and the clip plays from the textures on a clock of its own
+static const uint32_t CacheOff = 0;
+static const uint32_t CacheRecording = 1;
+static const uint32_t CacheComplete = 2; // Set by the render thread, Update suspends mp
+static const uint32_t CacheReady = 3;
+static const uint32_t CacheFailed = 4;   // Over the size limit, not tried again
+
+// The first frame recorded has to be this close to the start, the last one to the end
+static const uint64_t CacheStartWindow = 100000000ull;
+
+struct CachedFrame
+{
+    uint64_t time;
+    GLuint texture;
+};
+
+// A dmabuf waiting for the import worker, the fd is a dup of the frame's
+struct ImportJob
+{
+    int fd;
+    uint32_t serial;
+    uint32_t width;
+    uint32_t height;
+    uint64_t time;
+};
+
+// A frame imported ahead of RenderFrame. The fence is signaled when the import reached the GPU
+struct PreparedFrame
+{
+    uint32_t serial;
+    EGLImageKHR image;
+    GLuint texture;
+    EGLSyncKHR sync;
+};
+
+// Frames handed to the members of a shared decoder and not acked to mp yet, see OpenSharedMedia
+static const uint32_t MaxSharedFrames = 16;
+
+struct SharedFrame
+{
+    uint64_t time;
+    uint32_t holders; // Bits of the members that may still draw it
+};
+
+// What other threads read of a player, published as a whole by the thread that handled mp's
+// commands. Readers retry while it is being written
+struct StateSnapshot
+{
+    uint64_t time;
+    uint64_t duration;
+    uint32_t width;
+    uint32_t height;
+    uint32_t visibleRect[4];
+    float bufferingProgress;
+};
 
 struct GstMediaPlayerState
 {
@@ -85,72 +244,590 @@ struct GstMediaPlayerState
     sockaddr_un clientSockaddr;
     int videoServerSocket;
     int child;
+    int traceId;
+    bool inProcess;
+    ThreadScheduling scheduling;
+    EmbeddedChannel* channel;
+    void* embeddedPlayer;
     int fd;
+    uint32_t frameFlags;
+    uint64_t frameLatency;
+    GLuint planeTextures[2];
+    uint32_t planeWidth;
+    uint32_t planeHeight;
+    PendingFence pendingFences[MaxPendingFences];
+    uint32_t firstFence;
+    uint32_t lastFence;
+    bool readbackRequested;
+    uint32_t readbackWidth;
+    uint32_t readbackHeight;
+    uint32_t readbackFormat;
+    GLuint readbackTexture;
+    GLuint readbackFramebuffer;
+    uint32_t readbackTextureWidth;
+    uint32_t readbackTextureHeight;
+    uint32_t readbackTextureFormat;
+    PendingReadback readbacks[MaxReadbacks];
+    uint32_t firstReadback;
+    uint32_t lastReadback;
+    pthread_mutex_t readbackMutex; // Guards the completed readback, taken from any thread
+    uint8_t* readbackPixels;
+    uint32_t readbackCapacity;
+    uint32_t readbackPixelsWidth;
+    uint32_t readbackPixelsHeight;
+    uint32_t readbackPixelsFormat;
+    uint64_t readbackTime;
+    bool readbackReady;
     uint64_t duration;
     uint64_t time;
     uint64_t lastRenderTime;
     uint32_t width;
     uint32_t height;
+    uint32_t visibleRect[4]; // Picture inside the decoded frame, from the decoder's crop
+    uint32_t cropRect[4];    // Region of the picture shown, relative to visibleRect. Empty for all
     float volume;
     float balance;
     float speedRatio;
     bool isMuted;
     bool scrubbingEnabled;
+    bool isLooping;
+    bool isLive;
+    float bufferingProgress;
+    uint64_t latencyTarget;
     char tmpDir[256];
     pthread_t videoThread;
-    const void* streamPtr;
+    const void* streams[MaxStreams];
+    uint64_t streamPositions[MaxStreams];
+    uint64_t streamSizes[MaxStreams]; // 0 for live streams
+    IoBuffer ioBuffers[MaxStreams];
+    std::atomic<uint32_t> currentStream; // Item mp plays, the others are prerolling
+    bool ioScheduled;                 // Reads go through the I/O scheduler, set on OpenMedia
+    std::atomic<uint64_t> ioBytes;    // Written by the I/O thread only
+    std::atomic<uint64_t> ioWindowBytes;
+    std::atomic<uint64_t> ioWindowStart;
+    std::atomic<double> ioRate;       // Bytes per second over the last window
+    pthread_mutex_t streamMutex;
+    pthread_cond_t streamThreadsDone;
+    uint32_t streamThreads;
+    uint32_t streamCount;
+    uint64_t* keyframes;
+    uint32_t keyframeCount;
+    uint32_t keyframeCapacity;
+    bool keyframeIndexComplete;
+    uint64_t seekCost;
+    bool adaptiveQuality;
+    float maxFrameRate;
+    uint32_t qualityLevel;
+    uint32_t sentQualityLevel;
+    uint64_t sentThrottleTime;
+    uint64_t frameArrival;
+    uint64_t windowStart;
+    uint64_t windowLag;
+    uint32_t windowDropped;
+    uint32_t windowRendered;
+    uint32_t badWindows;
+    uint32_t goodWindows;
     ReadStream readFn;
     SeekStream seekFn;
     MediaOpened mediaOpenedFn;
     MediaEnded mediaEndedFn;
     MediaFailed mediaFailedFn;
     bool isValid;
+    GstMediaPlayerState* nextPlayer;
+    bool isVisible;
+    bool isSuspended;
+    uint32_t pinnedFrames; // Received and not acked yet, mp holds them
+    uint64_t lastDrawTime; // Written from the render thread, a stale value only delays a decision
+    uint64_t suspendTime;
+    uint32_t syncGroup;
+    GstMediaPlayerState* decoder; // Set in members of a shared decoder, which only draw
+    uint32_t sharedBit;
+    uint32_t sharedSerial;        // Frame handed out last, or held by the member
+    char sharingKey[256];         // The rest is used by shared decoders only
+    bool opening;                 // Published but still in OpenMedia, joiners wait for it
+    uint32_t members;             // One bit per member, 32 at most
+    int sharedFd;                 // Current frame, duplicated for members joining late
+    int sharedFence;              // Newest draw of any member, it signals after the earlier ones
+    SharedFrame sharedFrames[MaxSharedFrames];
+    uint32_t firstShared;
+    uint32_t lastShared;
+    pthread_mutex_t sharedMutex;  // Guards the shared frames, members ack from the render thread
+    EGLImageKHR sharedImage;
+    uint32_t sharedImageSerial;
+    uint32_t openedCount;         // Loaded, ended and failed events, followed by the members
+    uint32_t endedCount;
+    uint32_t failedCount;
+    uint32_t reportedOpened;      // Events already passed to the callbacks
+    uint32_t reportedEnded;
+    uint32_t reportedFailed;
+    bool eventPump;
+    bool pumpRunning;
+    bool pumpStop;
+    pthread_t pumpThread;
+    pthread_mutex_t eventMutex;   // Held while mp's commands are handled and while the frame is drawn
+    std::atomic<uint32_t> snapshotSequence; // Odd while the snapshot is written
+    StateSnapshot snapshot;
+    uint32_t cacheState;
+    CachedFrame* cacheFrames;     // Written by the render thread until the cache is ready
+    uint32_t cacheCount;
+    uint32_t cacheCapacity;
+    uint64_t cacheBytes;
+    uint32_t cacheWidth;
+    uint32_t cacheHeight;
+    GLuint cacheFramebuffer;
+    uint32_t cacheIndex;          // Frame shown
+    bool cachePlaying;
+    uint64_t cacheOrigin;         // Monotonic time of position 0 while playing
+    uint64_t cachePosition;       // While paused
+    uint32_t importSerial;        // Frames received, a prepared frame is drawn if it is the last
+    std::atomic<bool> importPending; // The last of them is not prepared yet
+    ImportJob importJob;
+    bool importQueued;
+    GstMediaPlayerState* nextImport;
+    PreparedFrame prepared;
 };
 
-void* VideoThreadFunc(void* state)
+// Members of a shared decoder, see OpenSharedMedia
+static void DetachMember(GstMediaPlayerState* st);
+static bool UpdateMember(GstMediaPlayerState* st);
+
+// Background event pump, see SetEventPump
+static void StartEventPump(GstMediaPlayerState* st);
+static void StopEventPump(GstMediaPlayerState* st);
+
+// Import worker, see SetImportThread
+static void StartImportWorker();
+static void StopImportWorker();
+static void QueueImport(GstMediaPlayerState* st, int fd);
+static void CancelImports(GstMediaPlayerState* st);
+static void RetirePreparedFrame(PreparedFrame& frame, bool drawn);
+
+static void PublishSnapshot(GstMediaPlayerState* st)
 {
-    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    uint32_t sequence = st->snapshotSequence.load(std::memory_order_relaxed);
+    st->snapshotSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 
-    while (1)
+    st->snapshot.time = st->time;
+    st->snapshot.duration = st->duration;
+    st->snapshot.width = st->width;
+    st->snapshot.height = st->height;
+    memcpy(st->snapshot.visibleRect, st->visibleRect, sizeof(st->visibleRect));
+    st->snapshot.bufferingProgress = st->bufferingProgress;
+
+    st->snapshotSequence.store(sequence + 2, std::memory_order_release);
+}
+
+static StateSnapshot ReadSnapshot(GstMediaPlayerState* st)
+{
+    StateSnapshot snapshot;
+    uint32_t sequence;
+    do
     {
-        sockaddr_un videoClientSockaddr;
-        socklen_t socklen = sizeof(sockaddr_un);
-        int videoSocket = accept(st->videoServerSocket, (struct sockaddr *) &videoClientSockaddr, &socklen);
+        sequence = st->snapshotSequence.load(std::memory_order_acquire);
+        snapshot = st->snapshot;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    while ((sequence & 1) != 0 || sequence != st->snapshotSequence.load(std::memory_order_relaxed));
+    return snapshot;
+}
+
+// Stream reads of every player are served by one thread, most urgent first, in blocks of
+// IoBlockSize kept per stream so the small sequential reads of appsrc hit memory instead of the
+// device. Players reading the same archive or flash no longer interleave and starve each other
+static bool IoScheduler = false;
+static uint32_t IoBlockSize = 256 * 1024;
+
+// Levels this close are treated as equal, the player that read least lately goes first
+static const int64_t IoLevelQuantum = 250000000ll;
+
+// Queued items prerolling ahead of time wait behind players about to run dry
+static const int64_t IoQueuedLevel = 2000000000ll;
+static const uint64_t IoRateWindow = 1000000000ull;
+
+struct IoRequest
+{
+    GstMediaPlayerState* st;
+    uint32_t index;
+    uint64_t offset;
+    uint8_t* data;
+    uint32_t size;
+    uint32_t readSize;
+    uint64_t arrival;
+    bool done;
+    IoRequest* next;
+};
+
+static pthread_mutex_t IoMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t IoCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t IoDoneCond = PTHREAD_COND_INITIALIZER;
+static IoRequest* IoQueue = nullptr;
+static pthread_t IoThread;
+static bool IoRunning = false;
+static bool IoStopping = false;
+
+static void FreeIoBuffers(GstMediaPlayerState* st)
+{
+    for (uint32_t i = 0; i < MaxStreams; i++)
+        free(st->ioBuffers[i].data);
+}
+
+// How far ahead of the time shown the pipeline has read, in ns. Estimated from its position in the
+// stream, which holds for a roughly constant bitrate. Unknown sizes and durations count as empty.
+// Time and duration come from the published snapshot, the pump and render threads write them
+static int64_t GetIoLevel(const IoRequest* request)
+{
+    GstMediaPlayerState* st = request->st;
+    if (request->index != st->currentStream % MaxStreams)
+        return IoQueuedLevel;
+
+    StateSnapshot snapshot = ReadSnapshot(st);
+    uint64_t size = st->streamSizes[request->index];
+    if (size == 0 || snapshot.duration == 0)
+        return 0;
+
+    return (int64_t)((double)request->offset / size * snapshot.duration) - (int64_t)snapshot.time;
+}
+
+static bool IsIoBefore(const IoRequest* a, int64_t levelA, const IoRequest* b, int64_t levelB)
+{
+    if (levelA / IoLevelQuantum != levelB / IoLevelQuantum)
+        return levelA < levelB;
+    if (a->st->ioWindowBytes != b->st->ioWindowBytes)
+        return a->st->ioWindowBytes < b->st->ioWindowBytes;
+    return a->arrival < b->arrival;
+}
+
+// Copies what the block read last holds, called with the player's streamMutex held
+static uint32_t CopyIoBuffer(GstMediaPlayerState* st, uint32_t index, uint64_t offset, uint8_t* data,
+    uint32_t size)
+{
+    const IoBuffer& buffer = st->ioBuffers[index];
+    if (offset < buffer.offset || offset >= buffer.offset + buffer.size)
+        return 0;
+
+    uint64_t available = buffer.offset + buffer.size - offset;
+    uint32_t copied = available < size ? (uint32_t)available : size;
+    memcpy(data, buffer.data + (offset - buffer.offset), copied);
+    return copied;
+}
+
+// Reads a whole block from where the request starts, short only at the end of the stream
+static void ServeIoRequest(IoRequest* request)
+{
+    GstMediaPlayerState* st = request->st;
+    uint32_t index = request->index;
+    IoBuffer& buffer = st->ioBuffers[index];
+    uint32_t blockSize = request->size > IoBlockSize ? request->size : IoBlockSize;
+
+    uint64_t start = MonotonicTime();
+    pthread_mutex_lock(&st->streamMutex);
+    if (buffer.capacity < blockSize)
+    {
+        buffer.data = (uint8_t*)realloc(buffer.data, blockSize);
+        buffer.capacity = blockSize;
+    }
+
+    if (st->streamPositions[index] != request->offset)
+        st->seekFn(st->streams[index], (uint32_t)request->offset);
+
+    uint32_t readSize = 0;
+    while (readSize < blockSize)
+    {
+        unsigned int s = st->readFn(st->streams[index], buffer.data + readSize, blockSize - readSize);
+        if (s == 0)
+            break;
+        readSize += s;
+    }
+    st->streamPositions[index] = request->offset + readSize;
+    buffer.offset = request->offset;
+    buffer.size = readSize;
+
+    request->readSize = CopyIoBuffer(st, index, request->offset, request->data, request->size);
+    pthread_mutex_unlock(&st->streamMutex);
+    TraceSpan("readFn", start, st->traceId, "size", readSize);
+
+    // Only this thread writes them, GetReadRate reads them without a lock
+    uint64_t now = MonotonicTime();
+    st->ioBytes += readSize;
+    st->ioWindowBytes += readSize;
+    if (now - st->ioWindowStart >= IoRateWindow)
+    {
+        st->ioRate = (double)st->ioWindowBytes * 1e9 / (double)(now - st->ioWindowStart.load());
+        st->ioWindowBytes = 0;
+        st->ioWindowStart = now;
+    }
+}
+
+static void* IoThreadFunc(void*)
+{
+    pthread_mutex_lock(&IoMutex);
+    while (true)
+    {
+        while (IoQueue == nullptr && !IoStopping)
+            pthread_cond_wait(&IoCond, &IoMutex);
+
+        // Readers still waiting are served first
+        if (IoQueue == nullptr)
+            break;
+
+        // Levels move while requests wait, so they are compared when picking
+        IoRequest** best = &IoQueue;
+        int64_t bestLevel = GetIoLevel(IoQueue);
+        for (IoRequest** link = &IoQueue->next; *link != nullptr; link = &(*link)->next)
+        {
+            int64_t level = GetIoLevel(*link);
+            if (IsIoBefore(*link, level, *best, bestLevel))
+            {
+                best = link;
+                bestLevel = level;
+            }
+        }
+
+        IoRequest* request = *best;
+        *best = request->next;
+        pthread_mutex_unlock(&IoMutex);
+
+        ServeIoRequest(request);
+
+        pthread_mutex_lock(&IoMutex);
+        request->done = true;
+        pthread_cond_broadcast(&IoDoneCond);
+    }
+    pthread_mutex_unlock(&IoMutex);
+    return nullptr;
+}
+
+// Joins the I/O thread, a later scheduled read starts it again
+static void StopIoThread()
+{
+    pthread_mutex_lock(&IoMutex);
+    if (!IoRunning)
+    {
+        pthread_mutex_unlock(&IoMutex);
+        return;
+    }
+    IoStopping = true;
+    pthread_cond_signal(&IoCond);
+    pthread_mutex_unlock(&IoMutex);
+
+    pthread_join(IoThread, nullptr);
+
+    pthread_mutex_lock(&IoMutex);
+    IoRunning = false;
+    IoStopping = false;
+    pthread_mutex_unlock(&IoMutex);
+}
+
+// Live streams block in readFn until data arrives, so they never go through the shared thread.
+// They are never sought, and streamMutex is not held while waiting so the scheduler can still
+// serve the other streams of this player
+static uint32_t LiveRead(GstMediaPlayerState* st, uint32_t index, uint8_t* data, uint32_t size)
+{
+    uint32_t readSize = 0;
+    while (readSize < size)
+    {
+        unsigned int s = st->readFn(st->streams[index], data + readSize, size - readSize);
+        if (s == 0)
+            break;
+        readSize += s;
+    }
+
+    pthread_mutex_lock(&st->streamMutex);
+    st->streamPositions[index] += readSize;
+    pthread_mutex_unlock(&st->streamMutex);
+    return readSize;
+}
+
+// Blocks until the scheduler served the read. Requests are only queued for what the last block
+// read for the stream does not already hold
+static uint32_t ScheduledRead(GstMediaPlayerState* st, uint32_t index, uint64_t offset, uint8_t* data,
+    uint32_t size)
+{
+    if (st->streamSizes[index] == 0)
+        return LiveRead(st, index, data, size);
+
+    pthread_mutex_lock(&st->streamMutex);
+    uint32_t copied = CopyIoBuffer(st, index, offset, data, size);
+    pthread_mutex_unlock(&st->streamMutex);
+    if (copied == size)
+        return copied;
+
+    IoRequest request;
+    request.st = st;
+    request.index = index;
+    request.offset = offset + copied;
+    request.data = data + copied;
+    request.size = size - copied;
+    request.readSize = 0;
+    request.arrival = MonotonicTime();
+    request.done = false;
+    request.next = nullptr;
+
+    pthread_mutex_lock(&IoMutex);
+    if (IoStopping)
+    {
+        // Shutting down, the thread may have exited already
+        pthread_mutex_unlock(&IoMutex);
+        ServeIoRequest(&request);
+        return copied + request.readSize;
+    }
+
+    if (!IoRunning)
+    {
+        pthread_create(&IoThread, nullptr, IoThreadFunc, nullptr);
+        IoRunning = true;
+    }
+
+    IoRequest** link = &IoQueue;
+    while (*link != nullptr)
+        link = &(*link)->next;
+    *link = &request;
+    pthread_cond_signal(&IoCond);
+
+    while (!request.done)
+        pthread_cond_wait(&IoDoneCond, &IoMutex);
+    pthread_mutex_unlock(&IoMutex);
+
+    return copied + request.readSize;
+}
+
+#ifdef MP_IN_PROCESS
+// Embedded pipelines read through the scheduler too, see ReadData in mp.cpp
+static unsigned int EmbeddedReadAt(void* host, uint32_t index, uint64_t offset, void* buffer,
+    unsigned int size)
+{
+    return ScheduledRead((GstMediaPlayerState*)host, index, offset, (uint8_t*)buffer, size);
+}
+#endif
+
+struct StreamChannel
+{
+    GstMediaPlayerState* st;
+    int videoSocket;
+};
+
+// DestroyState waits for every stream thread before the state goes away
+static void StreamThreadExit(GstMediaPlayerState* st)
+{
+    pthread_mutex_lock(&st->streamMutex);
+    if (--st->streamThreads == 0)
+        pthread_cond_broadcast(&st->streamThreadsDone);
+    pthread_mutex_unlock(&st->streamMutex);
+}
+
+// Serves the reads of one mp pipeline. Each channel starts with MPC_StreamChannel naming the
+// stream, so the current item and a prerolling queued item can read concurrently. Reads carry
+// their offset and the host stream is only sought when another channel moved it
+void* StreamThreadFunc(void* data)
+{
+    StreamChannel* channel = (StreamChannel*)data;
+    GstMediaPlayerState* st = channel->st;
+    int videoSocket = channel->videoSocket;
+    delete channel;
+
+    MediaPlayerCommand command;
+    if (recv(videoSocket, &command, sizeof(command), 0) <= 0 || command.cmd != MPC_StreamChannel)
+    {
+        close(videoSocket);
+        StreamThreadExit(st);
+        return nullptr;
+    }
+
+    uint32_t index = command.arg[0] % MaxStreams;
+    const void* streamPtr = st->streams[index];
 
-        const unsigned int BUFFER_SIZE = 4 * 1024;
-        char buffer[BUFFER_SIZE];
-        unsigned int read_size;
-        do
+    const unsigned int BUFFER_SIZE = 4 * 1024;
+    char buffer[BUFFER_SIZE];
+    unsigned int read_size;
+    uint8_t* scheduled = nullptr;
+    uint32_t scheduledCapacity = 0;
+    do
+    {
+        if (recv(videoSocket, &command, sizeof(command), 0) <= 0)
+            break;
+
+        if (command.cmd == MPC_Play && st->ioScheduled)
         {
-            MediaPlayerCommand command;
-            if (recv(videoSocket, &command, sizeof(command), 0) == -1)
+            uint32_t size = (uint32_t)command.arg[0];
+            if (scheduledCapacity < size)
+            {
+                scheduled = (uint8_t*)realloc(scheduled, size);
+                scheduledCapacity = size;
+            }
+
+            read_size = ScheduledRead(st, index, command.arg[1], scheduled, size);
+            send(videoSocket, scheduled, read_size, MSG_NOSIGNAL);
+            if (read_size < size)
                 break;
+        }
+        else if (command.cmd == MPC_Play)
+        {
+            uint32_t size = (uint32_t)command.arg[0];
 
-            if (command.cmd == MPC_Play)
+            pthread_mutex_lock(&st->streamMutex);
+            if (st->streamPositions[index] != command.arg[1])
             {
-                uint32_t size = (uint32_t)command.arg[0];
-                while (size > 0)
-                {
-                    uint32_t batchSize = size > BUFFER_SIZE ? BUFFER_SIZE : size;
-                    read_size = st->readFn(st->streamPtr, buffer, batchSize);
-                    send(videoSocket, buffer, read_size, 0);
-                    size -= read_size;
-                    if (read_size == 0)
-                        break;
-                }
-
-                if (size > 0)
-                    break;
+                st->seekFn(streamPtr, (uint32_t)command.arg[1]);
+                st->streamPositions[index] = command.arg[1];
             }
-            else if (command.cmd == MPC_Seek)
+
+            while (size > 0)
             {
-                uint64_t offset = command.arg[0];
-                st->seekFn(st->streamPtr, (uint32_t)offset);
+                uint32_t batchSize = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+                uint64_t start = MonotonicTime();
+                read_size = st->readFn(streamPtr, buffer, batchSize);
+                TraceSpan("readFn", start, st->traceId, "size", batchSize);
+                send(videoSocket, buffer, read_size, MSG_NOSIGNAL);
+                st->streamPositions[index] += read_size;
+                size -= read_size;
+                if (read_size == 0)
+                    break;
             }
+            pthread_mutex_unlock(&st->streamMutex);
+
+            if (size > 0)
+                break;
         }
-        while (true);
+    }
+    while (true);
 
-        close(videoSocket);
+    free(scheduled);
+    close(videoSocket);
+    StreamThreadExit(st);
+    return nullptr;
+}
+
+// Stream threads are created from here and inherit its placement
+void* VideoThreadFunc(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    ApplyScheduling(&st->scheduling);
+
+    while (1)
+    {
+        sockaddr_un videoClientSockaddr;
+        socklen_t socklen = sizeof(sockaddr_un);
+        int videoSocket = accept(st->videoServerSocket, (struct sockaddr *) &videoClientSockaddr, &socklen);
+        if (videoSocket == -1)
+        {
+            // DestroyState shuts the socket down to stop us
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        StreamChannel* channel = new StreamChannel();
+        channel->st = st;
+        channel->videoSocket = videoSocket;
+
+        pthread_mutex_lock(&st->streamMutex);
+        st->streamThreads++;
+        pthread_mutex_unlock(&st->streamMutex);
+
+        pthread_t thread;
+        pthread_create(&thread, nullptr, StreamThreadFunc, channel);
+        pthread_detach(thread);
     }
     return nullptr;
 }
@@ -162,6 +839,8 @@ extern "C" void InitMediaPlayer()
     {
         IsInitialized = true;
 
+        TraceOpen(true);
+
         mVertexShader = glCreateShader(GL_VERTEX_SHADER);
         glShaderSource(mVertexShader, 1, &VertexShaderSource, nullptr);
         glCompileShader(mVertexShader);
@@ -174,6 +853,10 @@ extern "C" void InitMediaPlayer()
         glShaderSource(mBlankFragmentShader, 1, &BlankFragmentShaderSource, nullptr);
         glCompileShader(mBlankFragmentShader);
 
+        mNv12FragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(mNv12FragmentShader, 1, &Nv12FragmentShaderSource, nullptr);
+        glCompileShader(mNv12FragmentShader);
+
         mProgram = glCreateProgram();
         glAttachShader(mProgram, mVertexShader);
         glAttachShader(mProgram, mFragmentShader);
@@ -182,12 +865,38 @@ extern "C" void InitMediaPlayer()
         glLinkProgram(mProgram);
         
         mYuyvSamplerLocation = glGetUniformLocation(mProgram, "s_yuyv_texture");
+        mTexRectLocation = glGetUniformLocation(mProgram, "u_tex_rect");
 
         mBlankProgram = glCreateProgram();
         glAttachShader(mBlankProgram, mVertexShader);
         glAttachShader(mBlankProgram, mBlankFragmentShader);
         glLinkProgram(mBlankProgram);
 
+        mNv12Program = glCreateProgram();
+        glAttachShader(mNv12Program, mVertexShader);
+        glAttachShader(mNv12Program, mNv12FragmentShader);
+        glBindAttribLocation(mNv12Program, 0, "a_position");
+        glBindAttribLocation(mNv12Program, 1, "a_tex_coord");
+        glLinkProgram(mNv12Program);
+
+        mYSamplerLocation = glGetUniformLocation(mNv12Program, "s_y_texture");
+        mUVSamplerLocation = glGetUniformLocation(mNv12Program, "s_uv_texture");
+        mNv12TexRectLocation = glGetUniformLocation(mNv12Program, "u_tex_rect");
+
+        mRgbaFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(mRgbaFragmentShader, 1, &RgbaFragmentShaderSource, nullptr);
+        glCompileShader(mRgbaFragmentShader);
+
+        mRgbaProgram = glCreateProgram();
+        glAttachShader(mRgbaProgram, mVertexShader);
+        glAttachShader(mRgbaProgram, mRgbaFragmentShader);
+        glBindAttribLocation(mRgbaProgram, 0, "a_position");
+        glBindAttribLocation(mRgbaProgram, 1, "a_tex_coord");
+        glLinkProgram(mRgbaProgram);
+
+        mRgbaSamplerLocation = glGetUniformLocation(mRgbaProgram, "s_rgba_texture");
+        mRgbaTexRectLocation = glGetUniformLocation(mRgbaProgram, "u_tex_rect");
+
         GLfloat vertices[] = {
             -1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
             -1.0f, -1.0f, 0.0f, 0.0f, 1.0f,
@@ -206,9 +915,53 @@ extern "C" void InitMediaPlayer()
         CreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
         DestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
         EGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+        // Frames are handed back to mp when the GPU is done with them. A native fence fd lets mp
+        // wait for that itself, a plain fence is polled here and without either implicit sync is
+        // trusted as before
+        mDisplay = eglGetCurrentDisplay();
+        const char* extensions = eglQueryString(mDisplay, EGL_EXTENSIONS);
+        if (extensions != nullptr && strstr(extensions, "EGL_KHR_fence_sync") != nullptr)
+        {
+            CreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+            DestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+            ClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+            if (strstr(extensions, "EGL_ANDROID_native_fence_sync") != nullptr)
+                DupNativeFenceFDANDROID = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)eglGetProcAddress("eglDupNativeFenceFDANDROID");
+            if (strstr(extensions, "EGL_KHR_wait_sync") != nullptr)
+                WaitSyncKHR = (PFNEGLWAITSYNCKHRPROC)eglGetProcAddress("eglWaitSyncKHR");
+        }
+
+        const char* budget = getenv("MP_VIDEO_MEMORY_BUDGET");
+        if (budget != nullptr)
+            VideoMemoryBudget = strtoull(budget, nullptr, 0) * 1024 * 1024;
+
+        const char* cacheDuration = getenv("MP_FRAME_CACHE_DURATION");
+        if (cacheDuration != nullptr)
+            FrameCacheDuration = (uint64_t)(strtod(cacheDuration, nullptr) * 1e9);
+        const char* cacheSize = getenv("MP_FRAME_CACHE_SIZE");
+        if (cacheSize != nullptr)
+            FrameCacheSize = strtoull(cacheSize, nullptr, 0) * 1024 * 1024;
+
+        const char* ioScheduler = getenv("MP_IO_SCHEDULER");
+        IoScheduler = ioScheduler != nullptr && strcmp(ioScheduler, "0") != 0;
+        const char* ioBlockSize = getenv("MP_IO_BLOCK_SIZE");
+        if (ioBlockSize != nullptr && strtoul(ioBlockSize, nullptr, 0) != 0)
+            IoBlockSize = (uint32_t)strtoul(ioBlockSize, nullptr, 0) * 1024;
+
+        const char* importThread = getenv("MP_IMPORT_THREAD");
+        ImportThread = importThread != nullptr && strcmp(importThread, "0") != 0;
     }
 }
 
+// Stops the threads shared by every player, so none is left blocked when the library goes away.
+// Called once no player is open anymore
+extern "C" void ShutdownMediaPlayer()
+{
+    StopIoThread();
+    StopImportWorker();
+}
+
 extern "C" void* CreateState()
 {
     GstMediaPlayerState* st = new GstMediaPlayerState();
@@ -222,51 +975,438 @@ extern "C" void* CreateState()
     st->speedRatio = 1.0f;
     st->isMuted = false;
     st->scrubbingEnabled = false;
+    st->isLooping = false;
     st->isValid = false;
     st->fd = -1;
+    st->frameFlags = 0;
+    st->frameLatency = 0;
+    st->planeTextures[0] = 0;
+    st->planeTextures[1] = 0;
+    st->planeWidth = 0;
+    st->planeHeight = 0;
+    st->firstFence = 0;
+    st->lastFence = 0;
+    st->readbackRequested = false;
+    st->readbackTexture = 0;
+    st->readbackFramebuffer = 0;
+    memset(st->readbacks, 0, sizeof(st->readbacks));
+    st->firstReadback = 0;
+    st->lastReadback = 0;
+    pthread_mutex_init(&st->readbackMutex, nullptr);
+    st->readbackPixels = nullptr;
+    st->readbackCapacity = 0;
+    st->readbackReady = false;
+    st->serverSocket = -1;
+    st->child = 0;
+    st->videoServerSocket = -1;
+    st->bufferingProgress = 1.0f;
+    pthread_mutex_init(&st->streamMutex, nullptr);
+    pthread_cond_init(&st->streamThreadsDone, nullptr);
+    st->streamThreads = 0;
+    memset(st->streamSizes, 0, sizeof(st->streamSizes));
+    memset(st->ioBuffers, 0, sizeof(st->ioBuffers));
+    st->currentStream = 0;
+    st->ioScheduled = false;
+    st->ioBytes = 0;
+    st->ioWindowBytes = 0;
+    st->ioWindowStart = 0;
+    st->ioRate = 0.0;
+    st->keyframes = nullptr;
+    st->keyframeCount = 0;
+    st->keyframeCapacity = 0;
+    st->keyframeIndexComplete = false;
+    st->seekCost = 0;
+    st->adaptiveQuality = false;
+    st->maxFrameRate = 0.0f;
+    st->qualityLevel = 0;
+    st->sentQualityLevel = 0;
+    st->sentThrottleTime = 0;
+    st->frameArrival = 0;
+    st->windowStart = 0;
+    st->windowLag = 0;
+    st->windowDropped = 0;
+    st->windowRendered = 0;
+    st->badWindows = 0;
+    st->goodWindows = 0;
+    st->traceId = 0;
+    st->channel = nullptr;
+    st->embeddedPlayer = nullptr;
+    st->isVisible = true;
+    st->isSuspended = false;
+    st->pinnedFrames = 0;
+    st->lastDrawTime = 0;
+    st->suspendTime = 0;
+    st->syncGroup = 0;
+    st->decoder = nullptr;
+    st->sharedBit = 0;
+    st->sharedSerial = 0;
+    st->sharingKey[0] = 0;
+    st->opening = false;
+    st->members = 0;
+    st->sharedFd = -1;
+    st->sharedFence = -1;
+    st->firstShared = 0;
+    st->lastShared = 0;
+    pthread_mutex_init(&st->sharedMutex, nullptr);
+    st->sharedImage = EGL_NO_IMAGE_KHR;
+    st->sharedImageSerial = 0;
+    st->openedCount = 0;
+    st->endedCount = 0;
+    st->failedCount = 0;
+    st->reportedOpened = 0;
+    st->reportedEnded = 0;
+    st->reportedFailed = 0;
+    st->pumpRunning = false;
+    st->pumpStop = false;
+    pthread_mutex_init(&st->eventMutex, nullptr);
+    st->snapshotSequence.store(0);
+    PublishSnapshot(st);
+    st->cacheState = CacheOff;
+    st->cacheFrames = nullptr;
+    st->cacheCount = 0;
+    st->cacheCapacity = 0;
+    st->cacheBytes = 0;
+    st->cacheWidth = 0;
+    st->cacheHeight = 0;
+    st->cacheFramebuffer = 0;
+    st->cacheIndex = 0;
+    st->cachePlaying = false;
+    st->cacheOrigin = 0;
+    st->cachePosition = 0;
+    st->importSerial = 0;
+    st->importPending = false;
+    st->importJob.fd = -1;
+    st->importQueued = false;
+    st->nextImport = nullptr;
+    st->prepared.serial = 0;
+    st->prepared.image = EGL_NO_IMAGE_KHR;
+    st->prepared.texture = 0;
+    st->prepared.sync = EGL_NO_SYNC_KHR;
+
+    pthread_mutex_lock(&PlayersMutex);
+    st->nextPlayer = Players;
+    Players = st;
+    pthread_mutex_unlock(&PlayersMutex);
+
+    const char* inProcess = getenv("MP_IN_PROCESS");
+    st->inProcess = inProcess != nullptr && strcmp(inProcess, "0") != 0;
+    const char* eventPump = getenv("MP_EVENT_PUMP");
+    st->eventPump = eventPump != nullptr && strcmp(eventPump, "0") != 0;
+    InitScheduling(&st->scheduling);
     return st;
 }
 
-extern "C" void DestroyState(void* state)
+static void DestroyFences(GstMediaPlayerState* st)
 {
-    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
-    kill(st->child, SIGKILL);
-    waitpid(st->child, NULL, 0);
+    for (; st->firstFence != st->lastFence; st->firstFence = (st->firstFence + 1) % MaxPendingFences)
+        DestroySyncKHR(mDisplay, st->pendingFences[st->firstFence].sync);
+}
 
-    char tmpVideoPath[256];
-    strcpy(tmpVideoPath, st->tmpDir);
-    strcat(tmpVideoPath, "/video");
-    unlink(tmpVideoPath);
+static void DestroyReadbacks(GstMediaPlayerState* st)
+{
+    for (; st->firstReadback != st->lastReadback; st->firstReadback = (st->firstReadback + 1) % MaxReadbacks)
+        glDeleteSync(st->readbacks[st->firstReadback].sync);
 
-    char serverSocketPath[256];
-    strcpy(serverSocketPath, st->tmpDir);
-    strcat(serverSocketPath, "/server_socket");
-    unlink(serverSocketPath);
+    for (uint32_t i = 0; i < MaxReadbacks; i++)
+    {
+        if (st->readbacks[i].buffer != 0)
+            glDeleteBuffers(1, &st->readbacks[i].buffer);
+    }
 
-    char clientSocketPath[256];
-    strcpy(clientSocketPath, st->tmpDir);
-    strcat(clientSocketPath, "/client_socket");
-    unlink(clientSocketPath);
+    if (st->readbackFramebuffer != 0)
+        glDeleteFramebuffers(1, &st->readbackFramebuffer);
+    if (st->readbackTexture != 0)
+        glDeleteTextures(1, &st->readbackTexture);
 
-    rmdir(st->tmpDir);
+    free(st->readbackPixels);
+    pthread_mutex_destroy(&st->readbackMutex);
+}
 
-    delete st;
+// Textures of a cache that was dropped are only deleted from the render thread, or here
+static void ReleaseFrameCache(GstMediaPlayerState* st)
+{
+    for (uint32_t i = 0; i < st->cacheCount; i++)
+        glDeleteTextures(1, &st->cacheFrames[i].texture);
+    st->cacheCount = 0;
+    st->cacheBytes = 0;
 }
 
-extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* streamName, int64_t streamSize,
-    ReadStream readFn, SeekStream seekFn, MediaOpened mediaOpenedFn, MediaEnded mediaEndedFn, MediaFailed mediaFailedFn)
+static void DestroySharedImage(GstMediaPlayerState* st)
+{
+    if (st->sharedImage != EGL_NO_IMAGE_KHR && DestroyImageKHR(mDisplay, st->sharedImage))
+        mLiveImages--;
+    st->sharedImage = EGL_NO_IMAGE_KHR;
+}
+
+extern "C" void DestroyState(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    st->streamPtr = streamPtr;
-    st->readFn = readFn;
-    st->seekFn = seekFn;
+    StopEventPump(st);
+    CancelImports(st);
+    RetirePreparedFrame(st->prepared, false);
 
-    st->mediaOpenedFn = mediaOpenedFn;
-    st->mediaEndedFn = mediaEndedFn;
-    st->mediaFailedFn = mediaFailedFn;
+    pthread_mutex_lock(&PlayersMutex);
+    GstMediaPlayerState** link = &Players;
+    while (*link != st)
+        link = &(*link)->nextPlayer;
+    *link = st->nextPlayer;
+    pthread_mutex_unlock(&PlayersMutex);
 
-    strcpy(st->tmpDir, "/tmp/mpXXXXXX");
+    // Members never opened anything, their decoder goes away with the last of them
+    if (st->decoder != nullptr)
+    {
+        DetachMember(st);
+        DestroyFences(st);
+        DestroyReadbacks(st);
+
+        if (st->planeTextures[0] != 0)
+            glDeleteTextures(2, st->planeTextures);
+
+        pthread_mutex_destroy(&st->sharedMutex);
+        pthread_mutex_destroy(&st->eventMutex);
+        pthread_cond_destroy(&st->streamThreadsDone);
+        pthread_mutex_destroy(&st->streamMutex);
+        delete st;
+        return;
+    }
+
+    DestroyFences(st);
+    DestroyReadbacks(st);
+
+    ReleaseFrameCache(st);
+    if (st->cacheFramebuffer != 0)
+        glDeleteFramebuffers(1, &st->cacheFramebuffer);
+    free(st->cacheFrames);
+
+    DestroySharedImage(st);
+    if (st->sharedFd != -1)
+        close(st->sharedFd);
+    if (st->sharedFence != -1)
+        close(st->sharedFence);
+    pthread_mutex_destroy(&st->sharedMutex);
+    pthread_mutex_destroy(&st->eventMutex);
+
+    if (st->channel != nullptr)
+    {
+        StopEmbeddedPlayer(st->embeddedPlayer);
+
+        MediaPlayerCommand command;
+        int fd;
+        while (PopCommand(&st->channel->toHost, &command, &fd))
+        {
+            if (fd != -1)
+                close(fd);
+        }
+        while (PopCommand(&st->channel->toPlayer, &command, &fd))
+        {
+            if (fd != -1)
+                close(fd);
+        }
+
+        DestroyQueue(&st->channel->toHost);
+        DestroyQueue(&st->channel->toPlayer);
+        delete st->channel;
+
+        if (st->fd != -1)
+            close(st->fd);
+
+        if (st->planeTextures[0] != 0)
+            glDeleteTextures(2, st->planeTextures);
+
+        FreeIoBuffers(st);
+        free(st->keyframes);
+        pthread_cond_destroy(&st->streamThreadsDone);
+        pthread_mutex_destroy(&st->streamMutex);
+        delete st;
+        return;
+    }
+
+    if (st->child > 0)
+    {
+        kill(st->child, SIGKILL);
+        waitpid(st->child, NULL, 0);
+    }
+
+    // With mp gone every stream connection is closed, so the stream threads finish their current
+    // read and exit. Nothing may touch the state afterwards
+    if (st->videoServerSocket != -1)
+    {
+        shutdown(st->videoServerSocket, SHUT_RDWR);
+        pthread_join(st->videoThread, nullptr);
+        close(st->videoServerSocket);
+
+        pthread_mutex_lock(&st->streamMutex);
+        while (st->streamThreads != 0)
+            pthread_cond_wait(&st->streamThreadsDone, &st->streamMutex);
+        pthread_mutex_unlock(&st->streamMutex);
+    }
+
+    if (st->serverSocket != -1)
+        close(st->serverSocket);
+
+    char tmpVideoPath[256];
+    strcpy(tmpVideoPath, st->tmpDir);
+    strcat(tmpVideoPath, "/video");
+    unlink(tmpVideoPath);
+
+    char videoSocketPath[256];
+    strcpy(videoSocketPath, st->tmpDir);
+    strcat(videoSocketPath, "/video_socket");
+    unlink(videoSocketPath);
+
+    char serverSocketPath[256];
+    strcpy(serverSocketPath, st->tmpDir);
+    strcat(serverSocketPath, "/server_socket");
+    unlink(serverSocketPath);
+
+    char clientSocketPath[256];
+    strcpy(clientSocketPath, st->tmpDir);
+    strcat(clientSocketPath, "/client_socket");
+    unlink(clientSocketPath);
+
+    rmdir(st->tmpDir);
+
+    if (st->fd != -1)
+        close(st->fd);
+
+    if (st->planeTextures[0] != 0)
+        glDeleteTextures(2, st->planeTextures);
+
+    FreeIoBuffers(st);
+    free(st->keyframes);
+    pthread_cond_destroy(&st->streamThreadsDone);
+    pthread_mutex_destroy(&st->streamMutex);
+    delete st;
+}
+
+// Members send everything to their shared decoder
+static void SendCommand(GstMediaPlayerState* st, MediaPlayerCommand* command)
+{
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    command->flags = 0;
+    command->stamp = MonotonicTime();
+    if (st->channel != nullptr)
+        PushCommand(&st->channel->toPlayer, command, -1);
+    else if (st->serverSocket != -1)
+        sendto(st->serverSocket, command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+}
+
+// Returns false once nothing is pending. fd is the frame of MPC_NewFrame, -1 otherwise
+static bool ReceiveCommand(GstMediaPlayerState* st, MediaPlayerCommand* command, int* fd)
+{
+    *fd = -1;
+    if (st->channel != nullptr)
+        return PopCommand(&st->channel->toHost, command, fd);
+
+    msghdr msg;
+    iovec iov;
+    cmsghdr *cmsg;
+    char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
+    memset(&msg, 0, sizeof(msghdr));
+    memset(&iov, 0, sizeof(iovec));
+    iov.iov_base = command;
+    iov.iov_len = sizeof(MediaPlayerCommand);
+    msg.msg_name = nullptr;
+    msg.msg_namelen = 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buffer;
+    msg.msg_controllen = sizeof(cmsg_buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = sizeof(cmsg_buffer);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+
+    if (recvmsg(st->serverSocket, &msg, 0) == -1)
+    {
+        assert(errno == EAGAIN || errno == EWOULDBLOCK);
+        return false;
+    }
+
+    if (command->cmd == MPC_NewFrame)
+        *fd = *((int *)CMSG_DATA(cmsg));
+    return true;
+}
+
+#ifdef MP_IN_PROCESS
+// Runs the pipeline on a thread of this process instead of spawning mp. Frames and commands go
+// through in-memory rings and the streams are read directly, no sockets or tmp dir are created
+static bool OpenEmbedded(GstMediaPlayerState* st, const char* streamName, int64_t streamSize)
+{
+    // Players may be opened from any thread
+    static std::atomic<int> embeddedCount(0);
+
+    st->channel = new EmbeddedChannel();
+    InitQueue(&st->channel->toHost);
+    InitQueue(&st->channel->toPlayer);
+    st->channel->readFn = st->readFn;
+    st->channel->seekFn = st->seekFn;
+    st->channel->streams = st->streams;
+    st->channel->streamPositions = st->streamPositions;
+    st->channel->streamMutex = &st->streamMutex;
+    st->channel->maxStreams = MaxStreams;
+    st->channel->readAtFn = st->ioScheduled ? EmbeddedReadAt : nullptr;
+    st->channel->host = st;
+    st->channel->traceId = st->traceId = -(++embeddedCount);
+    st->channel->scheduling = st->scheduling;
+
+    st->embeddedPlayer = StartEmbeddedPlayer(st->channel, streamSize, streamName);
+    if (st->embeddedPlayer == nullptr)
+    {
+        DestroyQueue(&st->channel->toHost);
+        DestroyQueue(&st->channel->toPlayer);
+        delete st->channel;
+        st->channel = nullptr;
+        return false;
+    }
+
+    // Same as the process mode, returns once the player prerolled and said hello
+    MediaPlayerCommand command;
+    while (!PopCommand(&st->channel->toHost, &command, nullptr))
+        WaitCommand(&st->channel->toHost, 100);
+
+    return true;
+}
+#endif
+
+extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* streamName, int64_t streamSize,
+    ReadStream readFn, SeekStream seekFn, MediaOpened mediaOpenedFn, MediaEnded mediaEndedFn, MediaFailed mediaFailedFn)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->streams[0] = streamPtr;
+    st->streamSizes[0] = streamSize > 0 ? (uint64_t)streamSize : 0;
+    st->streamCount = 1;
+    st->currentStream = 0;
+    st->ioScheduled = IoScheduler && streamSize >= 0; // A live feed would hold the shared thread
+    st->readFn = readFn;
+    st->seekFn = seekFn;
+
+    st->mediaOpenedFn = mediaOpenedFn;
+    st->mediaEndedFn = mediaEndedFn;
+    st->mediaFailedFn = mediaFailedFn;
+
+    // A negative size opens a live stream of unknown length, like a camera or encoder feed. It is
+    // read once from start to end and mp plays it with bounded, low-latency buffering
+    st->isLive = streamSize < 0;
+    st->bufferingProgress = st->isLive ? 0.0f : 1.0f;
+
+#ifdef MP_IN_PROCESS
+    if (st->inProcess)
+    {
+        if (!OpenEmbedded(st, streamName != nullptr ? streamName : "", streamSize))
+            return false;
+
+        if (st->eventPump)
+            StartEventPump(st);
+        return true;
+    }
+#endif
+
+    strcpy(st->tmpDir, "/tmp/mpXXXXXX");
     mkdtemp(st->tmpDir);
 
     st->serverSocket = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -293,7 +1433,7 @@ extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* stream
     unlink(videoServerSocketPath);
     bind(st->videoServerSocket, (sockaddr*)&videoServerSockaddr, sizeof(sockaddr_un));
 
-    listen(st->videoServerSocket, 1);
+    listen(st->videoServerSocket, 2);
 
     pthread_attr_t attr;
     pthread_attr_init(&attr);
@@ -303,10 +1443,12 @@ extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* stream
     if (st->child == 0)
     {
         prctl(PR_SET_PDEATHSIG, SIGKILL);
+        ApplyScheduling(&st->scheduling);
         char streamSizeStr[64];
         sprintf(streamSizeStr, "%ld", streamSize);
-        execlp("./mp", "mp", st->tmpDir, streamSizeStr, (char*)NULL);
+        execlp("./mp", "mp", st->tmpDir, streamSizeStr, streamName != nullptr ? streamName : "", (char*)NULL);
     }
+    st->traceId = st->child;
 
     MediaPlayerCommand command;
     socklen_t socklen = sizeof(sockaddr_un);
@@ -316,21 +1458,142 @@ extern "C" bool OpenMedia(void* state, const void* streamPtr, const char* stream
     flags |= O_NONBLOCK;
     fcntl(st->serverSocket, F_SETFL, flags);
 
+    if (st->eventPump)
+        StartEventPump(st);
+
+    return true;
+}
+
+// Position of a cached clip, wrapped to its duration
+static uint64_t GetCachePosition(GstMediaPlayerState* st, uint64_t now)
+{
+    uint64_t position = st->cachePlaying ? now - st->cacheOrigin : st->cachePosition;
+    return st->duration != 0 ? position % st->duration : 0;
+}
+
+// A cached clip that is no longer looping, or changes media, goes back to mp where it stands
+static void LeaveFrameCache(GstMediaPlayerState* st)
+{
+    if (st->cacheState != CacheReady)
+    {
+        if (st->cacheState != CacheFailed)
+            st->cacheState = CacheOff;
+        return;
+    }
+
+    uint64_t position = GetCachePosition(st, MonotonicTime());
+    st->cacheState = CacheOff;
+
+    MediaPlayerCommand command;
+    command.cmd = MPC_Resume;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
+    SendCommand(st, &command);
+
+    command.cmd = MPC_Seek;
+    command.arg[0] = position;
+    command.arg[1] = 0;
+    SendCommand(st, &command);
+
+    command.cmd = st->cachePlaying ? MPC_Play : MPC_Pause;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
+    SendCommand(st, &command);
+    TraceInstant("frame cache left", st->traceId, "pts", position);
+}
+
+// Index of the item mp plays. OpenMedia's stream is 0 and QueueMedia numbers the others in order,
+// so the streams of lower indices are no longer read and can be closed
+extern "C" uint32_t GetCurrentStream(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->currentStream;
+}
+
+// Queued items are not looked up in the probe cache, so unlike OpenMedia no stream name is needed
+extern "C" bool QueueMedia(void* state, const void* streamPtr, int64_t streamSize)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    // Slots from the item playing to the last one queued are in use. The ones before it are
+    // recycled once MPC_MediaChanged moves past them
+    if (st->streamCount - GetCurrentStream(st) >= MaxStreams)
+        return false;
+
+    LeaveFrameCache(st);
+
+    uint32_t index = st->streamCount++;
+    pthread_mutex_lock(&st->streamMutex);
+    st->streams[index % MaxStreams] = streamPtr;
+    st->streamPositions[index % MaxStreams] = 0;
+    st->streamSizes[index % MaxStreams] = streamSize > 0 ? (uint64_t)streamSize : 0;
+    st->ioBuffers[index % MaxStreams].size = 0;
+    pthread_mutex_unlock(&st->streamMutex);
+
+    MediaPlayerCommand command;
+    command.cmd = MPC_Queue;
+    command.arg[0] = index;
+    command.arg[1] = streamSize;
+
+    SendCommand(st, &command);
     return true;
 }
 
+// Frame area that is drawn: the crop region, or else the visible picture
+static void GetSourceRect(GstMediaPlayerState* st, const uint32_t visibleRect[4], uint32_t width,
+    uint32_t height, uint32_t rect[4])
+{
+    rect[0] = visibleRect[0];
+    rect[1] = visibleRect[1];
+    rect[2] = visibleRect[2] != 0 ? visibleRect[2] : width;
+    rect[3] = visibleRect[3] != 0 ? visibleRect[3] : height;
+
+    if (st->cropRect[2] != 0 && st->cropRect[3] != 0 && st->cropRect[0] < rect[2] && st->cropRect[1] < rect[3])
+    {
+        rect[0] += st->cropRect[0];
+        rect[1] += st->cropRect[1];
+        rect[2] = st->cropRect[0] + st->cropRect[2] > rect[2] ? rect[2] - st->cropRect[0] : st->cropRect[2];
+        rect[3] = st->cropRect[1] + st->cropRect[3] > rect[3] ? rect[3] - st->cropRect[1] : st->cropRect[3];
+    }
+}
+
+// Of the frame about to be drawn, only used where the frame is drawn
+static void GetSourceRect(GstMediaPlayerState* st, uint32_t rect[4])
+{
+    GetSourceRect(st, st->visibleRect, st->width, st->height, rect);
+}
+
 extern "C" uint32_t GetWidth(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return st->width;
+    StateSnapshot snapshot = ReadSnapshot(st);
+    uint32_t rect[4];
+    GetSourceRect(st, snapshot.visibleRect, snapshot.width, snapshot.height, rect);
+    return rect[2];
 }
 
 extern "C" uint32_t GetHeight(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return st->height;
+    StateSnapshot snapshot = ReadSnapshot(st);
+    uint32_t rect[4];
+    GetSourceRect(st, snapshot.visibleRect, snapshot.width, snapshot.height, rect);
+    return rect[3];
+}
+
+// Shows only a region of the video, in pixels of the visible picture. Several players of an atlas
+// video can each show their own region. An empty rectangle shows the whole picture
+extern "C" void SetCropRect(void* state, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->cropRect[0] = x;
+    st->cropRect[1] = y;
+    st->cropRect[2] = width;
+    st->cropRect[3] = height;
 }
 
 extern "C" bool GetCanPause(void* state)
@@ -353,11 +1616,44 @@ extern "C" bool GetHasVideo(void* state)
 
     return true;
 }
+
+// Fill level of the demuxed queues of a live stream, relative to the latency target. Always 1 for
+// media that is not live
 extern "C" float GetBufferingProgress(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return 1.0f;
+    return ReadSnapshot(st).bufferingProgress;
+}
+
+extern "C" bool GetIsLive(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->isLive;
+}
+
+extern "C" double GetLatencyTarget(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return (double)st->latencyTarget * 1e-9;
+}
+
+// How far behind capture live frames are shown, in seconds. 0 uses the lowest latency the pipeline
+// can do. The demuxed queues are only sized from it on the next OpenMedia
+extern "C" void SetLatencyTarget(void* state, double latencyTarget)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->latencyTarget = (uint64_t)(latencyTarget * 1e9);
+
+    MediaPlayerCommand command;
+    command.cmd = MPC_Latency;
+    command.arg[0] = st->latencyTarget;
+    command.arg[1] = 0;
+
+    SendCommand(st, &command);
 }
 
 extern "C" float GetDownloadProgress(void* state)
@@ -371,14 +1667,64 @@ extern "C" double GetDuration(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return (double)st->duration * 1e-9;
+    // Live streams have no duration
+    if (st->isLive)
+        return 0.0;
+
+    return (double)ReadSnapshot(st).duration * 1e-9;
 }
 
 extern "C" double GetTime(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return (double)st->time * 1e-9;
+    return (double)ReadSnapshot(st).time * 1e-9;
+}
+
+extern "C" double GetFrameLatency(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return (double)st->frameLatency * 1e-9;
+}
+
+// EGLImages created and not yet destroyed, across all players. Used to detect leaks in soak runs
+extern "C" uint32_t GetLiveImageCount()
+{
+    return mLiveImages;
+}
+
+// Copies up to maxCount keyframe times, in seconds, and returns how many are indexed so far.
+// Seeking to one of them needs no decode-forward
+extern "C" uint32_t GetKeyframes(void* state, double* times, uint32_t maxCount)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    // The event pump may grow the array meanwhile
+    pthread_mutex_lock(&st->eventMutex);
+    for (uint32_t i = 0; i < st->keyframeCount && i < maxCount; i++)
+        times[i] = (double)st->keyframes[i] * 1e-9;
+    uint32_t count = st->keyframeCount;
+    pthread_mutex_unlock(&st->eventMutex);
+
+    return count;
+}
+
+extern "C" bool GetKeyframeIndexComplete(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->keyframeIndexComplete;
+}
+
+// Time mp has to decode forward from the preceding keyframe to reach the last seek target
+extern "C" double GetSeekCost(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return (double)st->seekCost * 1e-9;
 }
 
 extern "C" float GetSpeedRatio(void* state)
@@ -419,7 +1765,7 @@ extern "C" void SetVolume(void* state, float volume)
     command.arg[0] = cast.u;
     command.arg[1] = 0;
 
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+    SendCommand(st, &command);
 }
 
 extern "C" float GetBalance(void* state)
@@ -464,209 +1810,2378 @@ extern "C" void SetScrubbingEnabled(void* state, bool scrubbingEnabled)
     st->scrubbingEnabled = scrubbingEnabled;
 }
 
-extern "C" void Play(void* state)
+extern "C" bool GetIsLooping(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    MediaPlayerCommand command;
-    command.cmd = MPC_Play;
-    command.arg[0] = 0;
-    command.arg[1] = 0;
-
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+    return st->isLooping;
 }
 
-extern "C" void Pause(void* state)
+extern "C" void SetIsLooping(void* state, bool isLooping)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
+    st->isLooping = isLooping;
+    if (!isLooping)
+        LeaveFrameCache(st);
+    else if (st->cacheState == CacheFailed)
+        st->cacheState = CacheOff;
+
     MediaPlayerCommand command;
-    command.cmd = MPC_Pause;
-    command.arg[0] = 0;
+    command.cmd = MPC_Loop;
+    command.arg[0] = isLooping ? 1 : 0;
     command.arg[1] = 0;
 
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+    SendCommand(st, &command);
 }
 
-extern "C" void Seek(void* state, double position)
+extern "C" bool GetInProcess(void* state)
 {
+#ifdef MP_IN_PROCESS
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    MediaPlayerCommand command;
-    command.cmd = MPC_Seek;
-    command.arg[0] = (uint64_t)(position * 1e9);
-    command.arg[1] = 0;
-
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+    return st->inProcess;
+#else
+    (void)state;
+    return false;
+#endif
 }
 
-extern "C" void Stop(void* state)
+extern "C" uint64_t GetCpuAffinity(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    MediaPlayerCommand command;
-    command.cmd = MPC_Stop;
-    command.arg[0] = 0;
-    command.arg[1] = 0;
+    return st->scheduling.cpuMask;
+}
 
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+// Mask of the cores the video threads may run on, 0 for any. Like the scheduling policy, it only
+// takes effect on the next OpenMedia
+extern "C" void SetCpuAffinity(void* state, uint64_t cpuMask)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->scheduling.cpuMask = cpuMask;
 }
 
-extern "C" bool HasNewFrame(void* state)
+extern "C" int32_t GetSchedulingPolicy(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    return st->time != st->lastRenderTime;
+    return st->scheduling.policy;
 }
 
-extern "C" void RenderFrame(void* state)
+// A SCHED_* value, or -1 to inherit the policy of the calling thread
+extern "C" void SetSchedulingPolicy(void* state, int32_t policy)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    if (st->time == st->lastRenderTime)
-        return;
+    st->scheduling.policy = policy;
+}
 
-    if (st->fd == -1)
-    {
-        glDisable(GL_SCISSOR_TEST);
-        glUseProgram(mBlankProgram);
+extern "C" int32_t GetSchedulingPriority(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-        glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+    return st->scheduling.priority;
+}
 
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
+// Nice value, or the real-time priority for SCHED_FIFO and SCHED_RR
+extern "C" void SetSchedulingPriority(void* state, int32_t priority)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+    st->scheduling.priority = priority;
+}
 
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+// Only takes effect on the next OpenMedia. Ignored unless built with MP_IN_PROCESS
+extern "C" void SetInProcess(void* state, bool inProcess)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->inProcess = inProcess;
+}
+
+extern "C" void Play(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    if (st->cacheState == CacheReady)
+    {
+        if (!st->cachePlaying)
+            st->cacheOrigin = MonotonicTime() - st->cachePosition;
+        st->cachePlaying = true;
         return;
     }
 
-    glDisable(GL_SCISSOR_TEST);
-    glUseProgram(mProgram);
+    MediaPlayerCommand command;
+    command.cmd = MPC_Play;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
 
-    glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+    SendCommand(st, &command);
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+extern "C" void Pause(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+    if (st->cacheState == CacheReady)
+    {
+        st->cachePosition = GetCachePosition(st, MonotonicTime());
+        st->cachePlaying = false;
+        return;
+    }
 
-    EGLDisplay display = eglGetCurrentDisplay();
-    glActiveTexture(GL_TEXTURE0);
-    EGLint attribs[] = {
-        EGL_WIDTH, (int)st->width,
-        EGL_HEIGHT, (int)st->height,
-        EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_NV12,
-        EGL_DMA_BUF_PLANE0_FD_EXT, st->fd,
-        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-        EGL_DMA_BUF_PLANE0_PITCH_EXT, (int)st->width,
-        EGL_DMA_BUF_PLANE1_FD_EXT, st->fd,
-        EGL_DMA_BUF_PLANE1_OFFSET_EXT, (int)(st->width * st->height),
-        EGL_DMA_BUF_PLANE1_PITCH_EXT, (int)st->width,
-        EGL_NONE
-    };
+    MediaPlayerCommand command;
+    command.cmd = MPC_Pause;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
 
-    EGLImageKHR image = CreateImageKHR (display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
-    EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
-    // DestroyImageKHR(display, image);
+    SendCommand(st, &command);
+}
 
-    glUniform1i(mYuyvSamplerLocation, 0);
+extern "C" void Seek(void* state, double position)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-    // glFinish();
-    // printf("frametime %lu\n", st->time);
-    EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, EGL_NO_IMAGE_KHR);
-    DestroyImageKHR(display, image);
-    close(st->fd);
-    st->fd = -1;
-    // st->fd = 0;
+    if (st->cacheState == CacheReady)
+    {
+        st->cachePosition = (uint64_t)(position * 1e9);
+        st->cacheOrigin = MonotonicTime() - st->cachePosition;
+        return;
+    }
 
-    // if (st->time - st->lastRenderTime > 20000000)
-    // {
-    //     printf("frametime delta %lu\n", st->time - st->lastRenderTime);
-    // }
+    // Frames recorded so far may not follow on, the next loop is recorded instead
+    if (st->cacheState == CacheRecording)
+        st->cacheState = CacheOff;
 
-    st->lastRenderTime = st->time;
+    MediaPlayerCommand command;
+    command.cmd = MPC_Seek;
+    command.arg[0] = (uint64_t)(position * 1e9);
+    command.arg[1] = 0;
+
+    SendCommand(st, &command);
+}
+
+extern "C" void Stop(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    if (st->cacheState == CacheReady)
+    {
+        st->cachePosition = 0;
+        st->cachePlaying = false;
+        return;
+    }
 
     MediaPlayerCommand command;
-    command.cmd = MPC_FrameAck;
-    command.arg[0] = st->time;
-    sendto(st->serverSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&st->clientSockaddr, sizeof(struct sockaddr_un));
+    command.cmd = MPC_Stop;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
+
+    SendCommand(st, &command);
 }
 
-extern "C" bool IsValid(void* state)
+// Group commands take effect at the same CLOCK_MONOTONIC time in every member. The delay gives
+// each mp time to receive them, seeks also have to preroll
+static const uint64_t GroupStartDelay = 50000000ull;
+static const uint64_t GroupSeekDelay = 300000000ull;
+
+// Members of a shared decoder share its group, the decoder gets the command once
+static void SendGroupCommand(uint32_t group, MediaPlayerCommand* command)
+{
+    pthread_mutex_lock(&PlayersMutex);
+    for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+    {
+        GstMediaPlayerState* target = st->decoder != nullptr ? st->decoder : st;
+        if (target->syncGroup != group)
+            continue;
+
+        bool sent = false;
+        for (GstMediaPlayerState* it = Players; it != st && !sent; it = it->nextPlayer)
+            sent = (it->decoder != nullptr ? it->decoder : it) == target;
+        if (!sent)
+            SendCommand(target, command);
+    }
+    pthread_mutex_unlock(&PlayersMutex);
+}
+
+extern "C" uint32_t GetSyncGroup(void* state)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
 
-    return st->isValid;
+    return st->syncGroup;
 }
 
-extern "C" bool Update(void* state)
+// Players in the same group, any value but 0, run on one clock shared by every mp and are driven
+// together with GroupPlay, GroupPause and GroupSeek. A member of a shared decoder sets the group of
+// the decoder, and so of every member
+extern "C" void SetSyncGroup(void* state, uint32_t group)
 {
     GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    st->syncGroup = group;
+    if (group != 0)
+        LeaveFrameCache(st);
 
-    msghdr msg;
-    iovec iov;
-    cmsghdr *cmsg;
-    char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
     MediaPlayerCommand command;
-    memset(&msg, 0, sizeof(msghdr));
-    memset(&iov, 0, sizeof(iovec));
-    iov.iov_base = &command;
-    iov.iov_len = sizeof(MediaPlayerCommand);
-    msg.msg_name = nullptr;
-    msg.msg_namelen = 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cmsg_buffer;
-    msg.msg_controllen = sizeof(cmsg_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_len = sizeof(cmsg_buffer);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
+    command.cmd = MPC_SyncClock;
+    command.arg[0] = group != 0;
+    command.arg[1] = 0;
+
+    SendCommand(st, &command);
+}
+
+// Every member starts at the same clock time, from the running time it was paused at. Members
+// paused together and seeked together show the same frame
+extern "C" void GroupPlay(uint32_t group)
+{
+    MediaPlayerCommand command;
+    command.cmd = MPC_Play;
+    command.arg[0] = MonotonicTime() + GroupStartDelay;
+    command.arg[1] = 0;
+
+    SendGroupCommand(group, &command);
+}
+
+extern "C" void GroupPause(uint32_t group)
+{
+    MediaPlayerCommand command;
+    command.cmd = MPC_Pause;
+    command.arg[0] = MonotonicTime();
+    command.arg[1] = 0;
+
+    SendGroupCommand(group, &command);
+}
+
+// Playing members restart together once prerolled. A member slower than the delay shows its first
+// frames late and catches up
+extern "C" void GroupSeek(uint32_t group, double position)
+{
+    MediaPlayerCommand command;
+    command.cmd = MPC_Seek;
+    command.arg[0] = (uint64_t)(position * 1e9);
+    command.arg[1] = MonotonicTime() + GroupSeekDelay;
 
-    while (recvmsg(st->serverSocket, &msg, 0) != -1)
+    SendGroupCommand(group, &command);
+}
+
+// Frames superseded before they were rendered and render lag (frame arrival to FrameAck) are
+// measured per player over one second windows. Two bad windows in a row degrade the player one
+// level, five calm ones restore one. Drops across all players raise a global level that degrades
+// every adaptive player at once, so background videos give way before the UI misses frames
+static const uint64_t QualityWindow = 1000000000ull;
+static const uint64_t MaxRenderLag = 50000000ull;
+static const uint32_t MaxQualityLevel = 3;
+static const float DegradedFrameRate = 15.0f;
+
+static uint64_t GlobalWindowStart = 0;
+// Counted on the pump and render threads, read and reset here
+static std::atomic<uint32_t> GlobalDropped(0);
+static std::atomic<uint32_t> GlobalRendered(0);
+static std::atomic<uint32_t> GlobalQualityLevel(0);
+
+static void UpdateGlobalQuality(uint64_t now)
+{
+    if (GlobalWindowStart == 0)
+        GlobalWindowStart = now;
+    if (now - GlobalWindowStart < QualityWindow)
+        return;
+
+    uint32_t dropped = GlobalDropped.exchange(0);
+    uint32_t frames = dropped + GlobalRendered.exchange(0);
+    if (frames > 0 && dropped * 5 > frames)
+        GlobalQualityLevel = 1;
+    else if (dropped == 0)
+        GlobalQualityLevel = 0;
+
+    GlobalWindowStart = now;
+}
+
+static void UpdateQuality(GstMediaPlayerState* st)
+{
+    uint64_t now = MonotonicTime();
+    UpdateGlobalQuality(now);
+
+    if (st->windowStart == 0)
+        st->windowStart = now;
+    if (now - st->windowStart >= QualityWindow)
     {
-        if (command.cmd == MPC_NewFrame)
-        {
-            if (st->fd != -1)
-                close(st->fd);
-            st->fd = *((int *)CMSG_DATA(cmsg));
-            st->time = command.arg[0];
-            st->width = (uint32_t)(command.arg[1] >> 32);
-            st->height = (uint32_t)(command.arg[1] & 0xffffffff);
-            //return true;
-        }
-        else if (command.cmd == MPC_MediaEnded)
+        uint32_t frames = st->windowDropped + st->windowRendered;
+        uint64_t lag = st->windowRendered != 0 ? st->windowLag / st->windowRendered : 0;
+        bool behind = frames > 0 && (st->windowDropped * 10 > frames || lag > MaxRenderLag);
+        bool calm = st->windowDropped == 0 && lag < MaxRenderLag / 4;
+
+        st->badWindows = behind ? st->badWindows + 1 : 0;
+        st->goodWindows = calm ? st->goodWindows + 1 : 0;
+        if (st->badWindows >= 2 && st->qualityLevel < MaxQualityLevel)
         {
-            st->time = st->duration;
-            st->mediaEndedFn();
-            // return true;
+            st->qualityLevel++;
+            st->badWindows = 0;
         }
-        else if (command.cmd == MPC_MediaFailed)
+        else if (st->goodWindows >= 5 && st->qualityLevel > 0)
         {
-            st->isValid = false;
-            st->mediaFailedFn();
-            return false;
+            st->qualityLevel--;
+            st->goodWindows = 0;
         }
-        else if (command.cmd == MPC_MediaLoaded)
+
+        st->windowStart = now;
+        st->windowLag = 0;
+        st->windowDropped = 0;
+        st->windowRendered = 0;
+    }
+
+    uint32_t level = 0;
+    if (st->adaptiveQuality)
+    {
+        level = st->qualityLevel + GlobalQualityLevel;
+        level = level > MaxQualityLevel ? MaxQualityLevel : level;
+    }
+
+    float frameRate = st->maxFrameRate;
+    if (level >= 3 && (frameRate <= 0.0f || frameRate > DegradedFrameRate))
+        frameRate = DegradedFrameRate;
+    uint64_t throttleTime = frameRate > 0.0f ? (uint64_t)(1e9 / frameRate) : 0;
+
+    if (level != st->sentQualityLevel || throttleTime != st->sentThrottleTime)
+    {
+        st->sentQualityLevel = level;
+        st->sentThrottleTime = throttleTime;
+
+        MediaPlayerCommand command;
+        command.cmd = MPC_Quality;
+        command.arg[0] = level;
+        command.arg[1] = throttleTime;
+
+        SendCommand(st, &command);
+    }
+}
+
+extern "C" bool GetAdaptiveQuality(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->adaptiveQuality;
+}
+
+extern "C" void SetAdaptiveQuality(void* state, bool adaptiveQuality)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->adaptiveQuality = adaptiveQuality;
+}
+
+extern "C" float GetMaxFrameRate(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->maxFrameRate;
+}
+
+// Caps the frames mp delivers, 0 means no cap. Meant for decorative videos
+extern "C" void SetMaxFrameRate(void* state, float maxFrameRate)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->maxFrameRate = maxFrameRate;
+}
+
+extern "C" uint32_t GetQualityLevel(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->sentQualityLevel;
+}
+
+// Pixel buffers and fence syncs need ES 3.0, Noesis and the bench create ES 2.0 contexts. Checked
+// once, every player renders with the same context
+static bool HasPixelBuffers()
+{
+    static int major = 0;
+    if (major == 0)
+    {
+        const char* version = (const char*)glGetString(GL_VERSION);
+        if (version == nullptr || sscanf(version, "OpenGL ES %d", &major) != 1 || major < 2)
+            major = 2;
+    }
+    return major >= 3;
+}
+
+// Publishes the pixels for GetReadback. Rows are flipped so the first one is the top of the picture
+static void StoreReadback(GstMediaPlayerState* st, const uint8_t* data, uint32_t width, uint32_t height,
+    uint32_t format, uint64_t time)
+{
+    uint32_t rowSize = width * (format == MPR_RGB565 ? 2 : 4);
+    uint32_t size = rowSize * height;
+
+    pthread_mutex_lock(&st->readbackMutex);
+    if (st->readbackCapacity < size)
+    {
+        free(st->readbackPixels);
+        st->readbackPixels = (uint8_t*)malloc(size);
+        st->readbackCapacity = size;
+    }
+    for (uint32_t y = 0; y < height; y++)
+        memcpy(st->readbackPixels + y * rowSize, data + (height - 1 - y) * rowSize, rowSize);
+    st->readbackPixelsWidth = width;
+    st->readbackPixelsHeight = height;
+    st->readbackPixelsFormat = format;
+    st->readbackTime = time;
+    st->readbackReady = true;
+    pthread_mutex_unlock(&st->readbackMutex);
+}
+
+// Copies out the readbacks whose fence signaled, the newest one wins
+static void CollectReadbacks(GstMediaPlayerState* st)
+{
+    for (; st->firstReadback != st->lastReadback; st->firstReadback = (st->firstReadback + 1) % MaxReadbacks)
+    {
+        PendingReadback& readback = st->readbacks[st->firstReadback];
+        GLenum status = glClientWaitSync(readback.sync, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(readback.sync);
+
+        uint32_t size = readback.width * readback.height * (readback.format == MPR_RGB565 ? 2 : 4);
+
+        uint64_t start = MonotonicTime();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        const uint8_t* data = (const uint8_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+        if (data != nullptr)
         {
-            st->isValid = true;
-            st->duration = command.arg[0];
-            st->width = (uint32_t)(command.arg[1] >> 32);
-            st->height = (uint32_t)(command.arg[1] & 0xffffffff);
-            st->mediaOpenedFn();
-            // return true;
+            StoreReadback(st, data, readback.width, readback.height, readback.format, readback.time);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
         }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        TraceSpan("readback copy", start, st->traceId, "pts", readback.time);
+    }
+}
+
+// Draws the frame again into a texture of the requested size and packs it into the next pixel
+// buffer of the ring, nothing waits for the GPU here. Called right after the frame was drawn, with
+// its program, textures and uniforms still bound
+static void DrawReadback(GstMediaPlayerState* st)
+{
+    if (!st->readbackRequested)
+        return;
+
+    if ((st->lastReadback + 1) % MaxReadbacks == st->firstReadback)
+    {
+        CollectReadbacks(st);
+        if ((st->lastReadback + 1) % MaxReadbacks == st->firstReadback)
+            return;
     }
 
-    
+    uint32_t rect[4];
+    GetSourceRect(st, rect);
+    uint32_t width = st->readbackWidth != 0 ? st->readbackWidth : rect[2];
+    uint32_t height = st->readbackHeight != 0 ? st->readbackHeight : rect[3];
+    if (width == 0 || height == 0)
+        return;
+
+    GLint framebuffer;
+    GLint viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
 
-    assert(errno == EAGAIN || errno == EWOULDBLOCK);
-    return true;
+    if (st->readbackTexture == 0)
+    {
+        glGenTextures(1, &st->readbackTexture);
+        glGenFramebuffers(1, &st->readbackFramebuffer);
+    }
+
+    if (st->readbackTextureWidth != width || st->readbackTextureHeight != height ||
+        st->readbackTextureFormat != st->readbackFormat)
+    {
+        // Unit 2 is free, the frame textures stay bound to 0 and 1
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, st->readbackTexture);
+        if (st->readbackFormat == MPR_RGB565)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, nullptr);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, st->readbackFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, st->readbackTexture, 0);
+        st->readbackTextureWidth = width;
+        st->readbackTextureHeight = height;
+        st->readbackTextureFormat = st->readbackFormat;
+    }
+
+    uint64_t start = MonotonicTime();
+    glBindFramebuffer(GL_FRAMEBUFFER, st->readbackFramebuffer);
+    glViewport(0, 0, width, height);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+    uint32_t format = st->readbackFormat;
+    if (format == MPR_RGB565)
+    {
+        GLint readFormat;
+        GLint readType;
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &readFormat);
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &readType);
+        if (readFormat != GL_RGB || readType != GL_UNSIGNED_SHORT_5_6_5)
+            format = MPR_RGBA;
+    }
+
+    uint32_t size = width * height * (format == MPR_RGB565 ? 2 : 4);
+    if (!HasPixelBuffers())
+    {
+        // ES 2.0 can only read into client memory, which waits for the GPU right here
+        uint8_t* data = (uint8_t*)malloc(size);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        if (format == MPR_RGB565)
+            glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
+        else
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        StoreReadback(st, data, width, height, format, st->time);
+        free(data);
+        st->readbackRequested = false;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        TraceSpan("readback draw", start, st->traceId, "pts", st->time);
+        return;
+    }
+
+    PendingReadback& readback = st->readbacks[st->lastReadback];
+    if (readback.buffer == 0)
+        glGenBuffers(1, &readback.buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    if (readback.capacity < size)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+        readback.capacity = size;
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (format == MPR_RGB565)
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, nullptr);
+    else
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.time = st->time;
+    readback.width = width;
+    readback.height = height;
+    readback.format = format;
+    st->lastReadback = (st->lastReadback + 1) % MaxReadbacks;
+    st->readbackRequested = false;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    TraceSpan("readback draw", start, st->traceId, "pts", st->time);
+}
+
+// Reads back the next frame drawn, scaled to width x height or to the size shown when 0. The
+// pixels are ready a frame or two later, see GetReadback. Meant for periodic snapshots, the frame
+// is not decoded twice and the render thread never waits for the GPU, except on ES 2.0 contexts
+// that have no pixel buffers and read synchronously
+extern "C" void RequestReadback(void* state, uint32_t width, uint32_t height, uint32_t format)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->readbackWidth = width;
+    st->readbackHeight = height;
+    st->readbackFormat = format == MPR_RGB565 ? MPR_RGB565 : MPR_RGBA;
+    st->readbackRequested = true;
+}
+
+// Takes the last completed readback, top row first and tightly packed. Without room for it only
+// the description is returned and the readback is kept. Can be called from any thread
+extern "C" bool GetReadback(void* state, void* pixels, uint32_t size, uint32_t* width, uint32_t* height,
+    uint32_t* format, double* time)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    pthread_mutex_lock(&st->readbackMutex);
+    bool ready = st->readbackReady;
+    *width = ready ? st->readbackPixelsWidth : 0;
+    *height = ready ? st->readbackPixelsHeight : 0;
+    *format = ready ? st->readbackPixelsFormat : MPR_RGBA;
+    *time = ready ? st->readbackTime / 1e9 : 0.0;
+
+    uint32_t needed = *width * *height * (*format == MPR_RGB565 ? 2 : 4);
+    bool copied = ready && pixels != nullptr && size >= needed;
+    if (copied)
+    {
+        memcpy(pixels, st->readbackPixels, needed);
+        st->readbackReady = false;
+    }
+    pthread_mutex_unlock(&st->readbackMutex);
+
+    return copied;
+}
+
+// Called whenever the video is drawn, which is what tells the budget the player is on screen
+extern "C" bool HasNewFrame(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->lastDrawTime = MonotonicTime();
+
+    // Readbacks are collected here too, so the last one completes even when the video is paused
+    if (st->firstReadback != st->lastReadback)
+        CollectReadbacks(st);
+
+    // A frame still being imported is drawn on the next one, RenderFrame never imports it itself
+    return ReadSnapshot(st).time != st->lastRenderTime && !st->importPending;
+}
+
+// Maps the full quad texture coordinates to the source rect, the texture is never sampled outside
+static void SetTexRect(GstMediaPlayerState* st, GLint location, uint32_t width, uint32_t height)
+{
+    uint32_t rect[4];
+    GetSourceRect(st, rect);
+    glUniform4f(location, (float)rect[0] / width, (float)rect[1] / height, (float)rect[2] / width,
+        (float)rect[3] / height);
+}
+
+// Draws the frame once more into a new texture of the cache, at full size and top row first. Called
+// right after the frame was drawn, with its program and textures still bound
+static void RecordCacheFrame(GstMediaPlayerState* st, GLint texRectLocation)
+{
+    if (st->cacheState != CacheRecording)
+        return;
+
+    // Recording starts when the clip starts over
+    if (st->cacheCount == 0 && st->time > CacheStartWindow)
+        return;
+
+    if (st->cacheCount > 0 && st->time <= st->cacheFrames[st->cacheCount - 1].time)
+    {
+        // Wrapped around, frames dropped near the end leave it incomplete and the next loop is tried
+        bool whole = st->cacheFrames[st->cacheCount - 1].time + CacheStartWindow >= st->duration;
+        st->cacheState = whole ? CacheComplete : CacheOff;
+        return;
+    }
+
+    uint64_t frameBytes = (uint64_t)st->width * st->height * 4;
+    bool resized = st->cacheCount > 0 && (st->width != st->cacheWidth || st->height != st->cacheHeight);
+    if (resized || st->cacheBytes + frameBytes > FrameCacheSize)
+    {
+        st->cacheState = CacheFailed;
+        return;
+    }
+
+    if (st->cacheCount == st->cacheCapacity)
+    {
+        st->cacheCapacity = st->cacheCapacity == 0 ? 64 : 2 * st->cacheCapacity;
+        st->cacheFrames = (CachedFrame*)realloc(st->cacheFrames, st->cacheCapacity * sizeof(CachedFrame));
+    }
+
+    uint64_t start = MonotonicTime();
+    GLint framebuffer;
+    GLint viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Unit 2 is free, the frame textures stay bound to 0 and 1
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, st->width, st->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (st->cacheFramebuffer == 0)
+        glGenFramebuffers(1, &st->cacheFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, st->cacheFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glViewport(0, 0, st->width, st->height);
+
+    // The whole frame, flipped so the first row of the texture is the top of the picture
+    glUniform4f(texRectLocation, 0.0f, 1.0f, 1.0f, -1.0f);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    st->cacheFrames[st->cacheCount].time = st->time;
+    st->cacheFrames[st->cacheCount].texture = texture;
+    st->cacheCount++;
+    st->cacheBytes += frameBytes;
+    st->cacheWidth = st->width;
+    st->cacheHeight = st->height;
+    TraceSpan("cache frame", start, st->traceId, "pts", st->time);
+}
+
+// Both planes of an NV12 dmabuf, tightly packed
+static void GetDmaBufAttribs(EGLint* attribs, int fd, uint32_t width, uint32_t height)
+{
+    EGLint values[] = {
+        EGL_WIDTH, (int)width,
+        EGL_HEIGHT, (int)height,
+        EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_NV12,
+        EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT, (int)width,
+        EGL_DMA_BUF_PLANE1_FD_EXT, fd,
+        EGL_DMA_BUF_PLANE1_OFFSET_EXT, (int)(width * height),
+        EGL_DMA_BUF_PLANE1_PITCH_EXT, (int)width,
+        EGL_NONE
+    };
+    memcpy(attribs, values, sizeof(values));
+}
+
+// Members draw the frame through one EGLImage, imported by whichever member draws it first. Bound
+// under sharedMutex, ShareFrame destroys it from the thread calling Update when the next frame comes
+static void BindSharedImage(GstMediaPlayerState* st, EGLDisplay display, const EGLint* attribs)
+{
+    GstMediaPlayerState* decoder = st->decoder;
+
+    pthread_mutex_lock(&decoder->sharedMutex);
+    if (decoder->sharedImage == EGL_NO_IMAGE_KHR || decoder->sharedImageSerial != st->sharedSerial)
+    {
+        DestroySharedImage(decoder);
+        decoder->sharedImage = CreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+        decoder->sharedImageSerial = st->sharedSerial;
+        if (decoder->sharedImage != EGL_NO_IMAGE_KHR)
+            mLiveImages++;
+    }
+    EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, decoder->sharedImage);
+    pthread_mutex_unlock(&decoder->sharedMutex);
+}
+
+static void RenderDmaBufFrame(GstMediaPlayerState* st)
+{
+    glDisable(GL_SCISSOR_TEST);
+    glUseProgram(mProgram);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+
+    EGLDisplay display = eglGetCurrentDisplay();
+    glActiveTexture(GL_TEXTURE0);
+
+    bool shared = st->decoder != nullptr;
+    bool prepared = st->prepared.texture != 0 && st->prepared.serial == st->importSerial;
+    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+    if (prepared)
+    {
+        // The GPU waits for the worker's import, the render thread does not
+        if (st->prepared.sync != EGL_NO_SYNC_KHR)
+        {
+            WaitSyncKHR(display, st->prepared.sync, 0);
+            DestroySyncKHR(display, st->prepared.sync);
+            st->prepared.sync = EGL_NO_SYNC_KHR;
+        }
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, st->prepared.texture);
+    }
+    else
+    {
+        EGLint attribs[19];
+        GetDmaBufAttribs(attribs, st->fd, st->width, st->height);
+
+        uint64_t start = MonotonicTime();
+        if (shared)
+        {
+            BindSharedImage(st, display, attribs);
+        }
+        else
+        {
+            image = CreateImageKHR (display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+            if (image != EGL_NO_IMAGE_KHR)
+                mLiveImages++;
+            EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+        }
+        TraceSpan("EGLImage import", start, st->traceId, "pts", st->time);
+        // DestroyImageKHR(display, image);
+    }
+
+    glUniform1i(mYuyvSamplerLocation, 0);
+    SetTexRect(st, mTexRectLocation, st->width, st->height);
+
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    DrawReadback(st);
+    RecordCacheFrame(st, mTexRectLocation);
+    // printf("frametime %lu\n", st->time);
+    if (prepared)
+    {
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+        RetirePreparedFrame(st->prepared, true);
+        return;
+    }
+    EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, EGL_NO_IMAGE_KHR);
+    if (!shared && image != EGL_NO_IMAGE_KHR && DestroyImageKHR(display, image))
+        mLiveImages--;
+    // st->fd = 0;
+
+    // if (st->time - st->lastRenderTime > 20000000)
+    // {
+    //     printf("frametime delta %lu\n", st->time - st->lastRenderTime);
+    // }
+}
+
+// Frames decoded in software arrive as tightly packed NV12 in a memfd. Planes are uploaded to a
+// luminance and a luminance-alpha texture and converted in the shader
+static void RenderSharedFrame(GstMediaPlayerState* st)
+{
+    uint32_t uvWidth = (st->width + 1) / 2;
+    uint32_t uvHeight = (st->height + 1) / 2;
+    size_t size = st->width * st->height + 2 * uvWidth * uvHeight;
+
+    const uint8_t* data = (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, st->fd, 0);
+    if (data == MAP_FAILED)
+        return;
+
+    if (st->planeTextures[0] == 0)
+    {
+        glGenTextures(2, st->planeTextures);
+        for (int i = 0; i < 2; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, st->planeTextures[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, st->planeTextures[1]);
+    if (st->planeWidth != st->width || st->planeHeight != st->height)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, uvWidth, uvHeight, 0, GL_LUMINANCE_ALPHA,
+            GL_UNSIGNED_BYTE, data + st->width * st->height);
+    }
+    else
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, uvWidth, uvHeight, GL_LUMINANCE_ALPHA,
+            GL_UNSIGNED_BYTE, data + st->width * st->height);
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, st->planeTextures[0]);
+    if (st->planeWidth != st->width || st->planeHeight != st->height)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, st->width, st->height, 0, GL_LUMINANCE,
+            GL_UNSIGNED_BYTE, data);
+        st->planeWidth = st->width;
+        st->planeHeight = st->height;
+    }
+    else
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, st->width, st->height, GL_LUMINANCE,
+            GL_UNSIGNED_BYTE, data);
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    munmap((void*)data, size);
+
+    glDisable(GL_SCISSOR_TEST);
+    glUseProgram(mNv12Program);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+
+    glUniform1i(mYSamplerLocation, 0);
+    glUniform1i(mUVSamplerLocation, 1);
+    SetTexRect(st, mNv12TexRectLocation, st->width, st->height);
+
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    DrawReadback(st);
+    RecordCacheFrame(st, mNv12TexRectLocation);
+}
+
+static void RenderCachedFrame(GstMediaPlayerState* st)
+{
+    glDisable(GL_SCISSOR_TEST);
+    glUseProgram(mRgbaProgram);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, st->cacheFrames[st->cacheIndex].texture);
+    glUniform1i(mRgbaSamplerLocation, 0);
+    SetTexRect(st, mRgbaTexRectLocation, st->cacheWidth, st->cacheHeight);
+
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    DrawReadback(st);
+}
+
+// Hands the fd over to mp, which closes it
+static void SendCommand(GstMediaPlayerState* st, MediaPlayerCommand* command, int fd)
+{
+    command->flags = 0;
+    command->stamp = MonotonicTime();
+    if (st->channel != nullptr)
+    {
+        if (!PushCommand(&st->channel->toPlayer, command, fd))
+            close(fd);
+        return;
+    }
+
+    if (st->serverSocket != -1)
+    {
+        msghdr msg;
+        iovec iov;
+        cmsghdr *cmsg;
+        char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
+        memset(&msg, 0, sizeof(msghdr));
+        memset(&iov, 0, sizeof(iovec));
+        iov.iov_base = command;
+        iov.iov_len = sizeof(MediaPlayerCommand);
+        msg.msg_name = &st->clientSockaddr;
+        msg.msg_namelen = sizeof(sockaddr_un);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buffer;
+        msg.msg_controllen = sizeof(cmsg_buffer);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_len = sizeof(cmsg_buffer);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        *((int *)CMSG_DATA(cmsg)) = fd;
+        sendmsg(st->serverSocket, &msg, 0);
+    }
+
+    close(fd);
+}
+
+// Drops the member's hold on the newest frame shown at time and, unless only that one, on every
+// frame before it. A frame already acked to mp is not found and nothing changes
+static void ClearSharedHold(GstMediaPlayerState* decoder, uint32_t bit, uint64_t time, bool onlyThis)
+{
+    for (uint32_t i = decoder->lastShared; i != decoder->firstShared;)
+    {
+        i = (i + MaxSharedFrames - 1) % MaxSharedFrames;
+        SharedFrame& frame = decoder->sharedFrames[i];
+        if (frame.time == time && (frame.holders & bit) != 0)
+        {
+            frame.holders &= ~bit;
+            for (uint32_t j = decoder->firstShared; j != i && !onlyThis; j = (j + 1) % MaxSharedFrames)
+                decoder->sharedFrames[j].holders &= ~bit;
+            return;
+        }
+    }
+}
+
+// Acks the oldest frames no member holds anymore, in arrival order, or the oldest one regardless
+// with force. Members draw on one context, so the newest fence also covers the earlier draws
+static void FlushSharedFrames(GstMediaPlayerState* decoder, bool force)
+{
+    bool flushed = false;
+    uint64_t time = 0;
+    for (; decoder->firstShared != decoder->lastShared; decoder->firstShared = (decoder->firstShared + 1) % MaxSharedFrames)
+    {
+        SharedFrame& frame = decoder->sharedFrames[decoder->firstShared];
+        if (frame.holders != 0 && !force)
+            break;
+
+        time = frame.time;
+        flushed = true;
+        force = false;
+    }
+
+    if (flushed)
+    {
+        MediaPlayerCommand command;
+        command.cmd = MPC_FrameAck;
+        command.arg[0] = time;
+        if (decoder->sharedFence != -1)
+            SendCommand(decoder, &command, dup(decoder->sharedFence));
+        else
+            SendCommand(decoder, &command);
+        TraceInstant("MPC_FrameAck sent", decoder->traceId, "pts", time);
+    }
+
+    decoder->pinnedFrames = (decoder->lastShared + MaxSharedFrames - decoder->firstShared) % MaxSharedFrames;
+}
+
+static void ReleaseSharedFrames(GstMediaPlayerState* st, uint64_t time, int fence)
+{
+    GstMediaPlayerState* decoder = st->decoder;
+
+    pthread_mutex_lock(&decoder->sharedMutex);
+    if (fence != -1)
+    {
+        if (decoder->sharedFence != -1)
+            close(decoder->sharedFence);
+        decoder->sharedFence = fence;
+    }
+    ClearSharedHold(decoder, st->sharedBit, time, false);
+    FlushSharedFrames(decoder, false);
+    pthread_mutex_unlock(&decoder->sharedMutex);
+}
+
+// Acks every frame up to time. mp releases them right away, or once the fence signals if any.
+// Members only drop their hold, the frame is acked once no member holds it
+static void SendFrameAck(GstMediaPlayerState* st, uint64_t time, int fence)
+{
+    if (st->decoder != nullptr)
+    {
+        ReleaseSharedFrames(st, time, fence);
+        return;
+    }
+
+    MediaPlayerCommand command;
+    command.cmd = MPC_FrameAck;
+    command.arg[0] = time;
+    if (fence != -1)
+        SendCommand(st, &command, fence);
+    else
+        SendCommand(st, &command);
+    TraceInstant("MPC_FrameAck sent", st->traceId, "pts", time);
+
+    st->pinnedFrames = st->fd != -1 ? 1 : 0;
+}
+
+// Acks the newest draw the GPU already finished. With wait it blocks on the oldest one first
+static void AckFinishedFrames(GstMediaPlayerState* st, bool wait)
+{
+    bool finished = false;
+    uint64_t time = 0;
+    for (; st->firstFence != st->lastFence; st->firstFence = (st->firstFence + 1) % MaxPendingFences)
+    {
+        PendingFence& fence = st->pendingFences[st->firstFence];
+        EGLTimeKHR timeout = wait ? EGL_FOREVER_KHR : 0;
+        if (ClientWaitSyncKHR(mDisplay, fence.sync, 0, timeout) != EGL_CONDITION_SATISFIED_KHR)
+            break;
+
+        DestroySyncKHR(mDisplay, fence.sync);
+        time = fence.time;
+        finished = true;
+        wait = false;
+    }
+
+    if (finished)
+        SendFrameAck(st, time, -1);
+}
+
+// Acks a frame that was never drawn, and with it every frame before. Draws still waiting on their
+// fence are finished first, mp would otherwise release buffers the GPU may still be reading
+static void AckUndrawnFrame(GstMediaPlayerState* st, uint64_t time)
+{
+    while (st->firstFence != st->lastFence)
+        AckFinishedFrames(st, true);
+
+    SendFrameAck(st, time, -1);
+}
+
+// Releases the drawn frame without stalling. Shared memory frames are copied by glTexSubImage2D
+// so they need no fence
+static void FenceFrame(GstMediaPlayerState* st)
+{
+    if (!(st->frameFlags & MPF_SharedMemory) && DupNativeFenceFDANDROID != 0)
+    {
+        EGLint attribs[] = { EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID, EGL_NONE };
+        EGLSyncKHR sync = CreateSyncKHR(mDisplay, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+        if (sync != EGL_NO_SYNC_KHR)
+        {
+            // The fence fd only exists once the commands are flushed
+            glFlush();
+            int fence = DupNativeFenceFDANDROID(mDisplay, sync);
+            DestroySyncKHR(mDisplay, sync);
+            SendFrameAck(st, st->time, fence);
+            return;
+        }
+    }
+
+    if (!(st->frameFlags & MPF_SharedMemory) && CreateSyncKHR != 0)
+    {
+        EGLSyncKHR sync = CreateSyncKHR(mDisplay, EGL_SYNC_FENCE_KHR, nullptr);
+        if (sync != EGL_NO_SYNC_KHR)
+        {
+            glFlush();
+            if ((st->lastFence + 1) % MaxPendingFences == st->firstFence)
+                AckFinishedFrames(st, true);
+
+            st->pendingFences[st->lastFence].time = st->time;
+            st->pendingFences[st->lastFence].sync = sync;
+            st->lastFence = (st->lastFence + 1) % MaxPendingFences;
+            return;
+        }
+    }
+
+    SendFrameAck(st, st->time, -1);
+}
+
+static void DrawFrame(GstMediaPlayerState* st)
+{
+    // The worker's context is shared with the one current here. Without it frames import inline
+    static bool importTried = false;
+    if (ImportThread && !importTried)
+    {
+        importTried = true;
+        StartImportWorker();
+    }
+
+    if ((st->cacheState == CacheOff || st->cacheState == CacheFailed) && st->cacheCount != 0)
+        ReleaseFrameCache(st);
+
+    if (st->time == st->lastRenderTime)
+        return;
+
+    // Nothing to hand back, the frame stays in the cache
+    if (st->cacheState == CacheReady)
+    {
+        RenderCachedFrame(st);
+        st->lastRenderTime = st->time;
+        return;
+    }
+
+    if (st->fd == -1)
+    {
+        glDisable(GL_SCISSOR_TEST);
+        glUseProgram(mBlankProgram);
+
+        glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), 0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (const void*)(3 * sizeof(GLfloat)));
+
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        return;
+    }
+
+    uint64_t start = MonotonicTime();
+    if (st->frameFlags & MPF_SharedMemory)
+    {
+        RenderSharedFrame(st);
+    }
+    else
+    {
+        RenderDmaBufFrame(st);
+    }
+    TraceSpan("RenderFrame draw", start, st->traceId, "pts", st->time);
+
+    close(st->fd);
+    st->fd = -1;
+
+    st->lastRenderTime = st->time;
+
+    st->windowLag += MonotonicTime() - st->frameArrival;
+    st->windowRendered++;
+    GlobalRendered++;
+
+    FenceFrame(st);
+}
+
+// The event pump may hand over a new frame at any time, the one being drawn stays until done
+extern "C" void RenderFrame(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    pthread_mutex_lock(&st->eventMutex);
+    DrawFrame(st);
+    pthread_mutex_unlock(&st->eventMutex);
+}
+
+// Decoders are estimated to hold this many frames: references, their pool and the sink queue
+static const uint32_t DecoderFrames = 8;
+static const uint64_t PlayerProcessCost = 8 * 1024 * 1024;
+static const uint64_t BudgetInterval = 100000000ull;
+static const uint64_t IdleTime = 2000000000ull;
+
+// Estimated from the frame size, the decoder of a suspended player is gone. An mp process costs
+// the same either way
+static uint64_t EstimateVideoMemory(GstMediaPlayerState* st)
+{
+    // Members draw the frames of their decoder, which is estimated on its own
+    if (st->decoder != nullptr)
+        return 0;
+
+    uint64_t usage = st->child > 0 ? PlayerProcessCost : 0;
+    if (st->isValid && !st->isSuspended && st->cacheState != CacheReady)
+        usage += (uint64_t)st->width * st->height * 3 / 2 * (DecoderFrames + st->pinnedFrames);
+    return usage + st->cacheBytes;
+}
+
+// Live streams can't be brought back to where they were, and synchronized players would have to
+// seek to rejoin their group. Members follow their decoder, suspended once every member is hidden
+static bool CanSuspend(GstMediaPlayerState* st)
+{
+    return st->isValid && !st->isLive && !st->isSuspended && st->syncGroup == 0 && st->decoder == nullptr &&
+        st->cacheState != CacheReady;
+}
+
+// Whether the stream has audio is not known, so anything not muted may be heard. A collapsed
+// element can be playing background audio
+static bool IsAudible(GstMediaPlayerState* st)
+{
+    return !st->isMuted && st->volume > 0.0f;
+}
+
+// The frame not drawn yet is dropped, the render target keeps showing the last one drawn
+static void SuspendPlayer(GstMediaPlayerState* st, uint64_t now)
+{
+    pthread_mutex_lock(&st->eventMutex);
+    if (st->fd != -1)
+    {
+        close(st->fd);
+        st->fd = -1;
+        st->lastRenderTime = st->time;
+        AckUndrawnFrame(st, st->time);
+    }
+    RetirePreparedFrame(st->prepared, false);
+    pthread_mutex_unlock(&st->eventMutex);
+
+    MediaPlayerCommand command;
+    command.cmd = MPC_Suspend;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
+    SendCommand(st, &command);
+
+    st->isSuspended = true;
+    st->suspendTime = now;
+    TraceInstant("suspended", st->traceId, "pts", st->time);
+}
+
+static void ResumePlayer(GstMediaPlayerState* st)
+{
+    MediaPlayerCommand command;
+    command.cmd = MPC_Resume;
+    command.arg[0] = 0;
+    command.arg[1] = 0;
+    SendCommand(st, &command);
+
+    st->isSuspended = false;
+    st->lastDrawTime = MonotonicTime();
+    TraceInstant("resumed", st->traceId, "pts", st->time);
+}
+
+// With a budget set, hidden players that can't be heard are suspended right away. Players not drawn
+// for IdleTime are only suspended, least recently drawn first, while the estimate of every player
+// is over the budget. Suspended players resume as soon as they are shown or drawn again
+static void UpdateBudget(uint64_t now)
+{
+    if (now - BudgetCheckTime < BudgetInterval)
+        return;
+    BudgetCheckTime = now;
+
+    pthread_mutex_lock(&PlayersMutex);
+
+    uint64_t usage = 0;
+    for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+    {
+        if (st->isSuspended && st->isVisible && st->lastDrawTime > st->suspendTime)
+            ResumePlayer(st);
+        else if (VideoMemoryBudget != 0 && !st->isVisible && !IsAudible(st) && CanSuspend(st))
+            SuspendPlayer(st, now);
+        usage += EstimateVideoMemory(st);
+    }
+
+    while (VideoMemoryBudget != 0 && usage > VideoMemoryBudget)
+    {
+        GstMediaPlayerState* idle = nullptr;
+        for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+        {
+            if (CanSuspend(st) && now - st->lastDrawTime > IdleTime &&
+                (idle == nullptr || st->lastDrawTime < idle->lastDrawTime))
+            {
+                idle = st;
+            }
+        }
+
+        if (idle == nullptr)
+            break;
+
+        usage -= EstimateVideoMemory(idle);
+        SuspendPlayer(idle, now);
+        usage += EstimateVideoMemory(idle);
+    }
+
+    VideoMemoryUsage = usage;
+    pthread_mutex_unlock(&PlayersMutex);
+}
+
+extern "C" uint64_t GetVideoMemoryBudget()
+{
+    return VideoMemoryBudget;
+}
+
+// Shared by every player in the process, 0 for no budget. Defaults to MP_VIDEO_MEMORY_BUDGET,
+// in megabytes
+extern "C" void SetVideoMemoryBudget(uint64_t budget)
+{
+    VideoMemoryBudget = budget;
+}
+
+// Estimate of every player as of the last budget check
+extern "C" uint64_t GetVideoMemoryUsage()
+{
+    return VideoMemoryUsage;
+}
+
+extern "C" bool GetIsVisible(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->isVisible;
+}
+
+// With a video memory budget set, a hidden player that is muted or at zero volume is suspended on
+// the next Update and resumed once visible and drawn again
+extern "C" void SetIsVisible(void* state, bool isVisible)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->isVisible = isVisible;
+}
+
+extern "C" bool GetIsSuspended(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    return st->isSuspended;
+}
+
+extern "C" bool IsValid(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->isValid;
+}
+
+// Applies one of mp's commands, from Update or the event pump. Events are only counted, Update
+// passes them to the callbacks. Returns false once the media failed
+static bool HandleCommand(GstMediaPlayerState* st, const MediaPlayerCommand* command, int fd)
+{
+    if (command->cmd == MPC_NewFrame && st->cacheState == CacheReady)
+    {
+        // Decoded before mp was suspended
+        close(fd);
+        AckUndrawnFrame(st, command->arg[0]);
+    }
+    else if (command->cmd == MPC_NewFrame)
+    {
+        uint64_t start = MonotonicTime();
+        TraceFlow('f', start, st->traceId, command->arg[0]);
+        if (st->fd != -1)
+        {
+            // Superseded before it was rendered
+            close(st->fd);
+            st->windowDropped++;
+            GlobalDropped++;
+
+            // The recording would replay the gap forever, the next loop is tried instead
+            if (st->cacheState == CacheRecording)
+                st->cacheState = CacheOff;
+        }
+        st->fd = fd;
+        st->pinnedFrames++;
+        st->frameArrival = start;
+        st->frameFlags = command->flags;
+        st->frameLatency = MonotonicTime() - command->stamp;
+        st->time = command->arg[0];
+        st->width = (uint32_t)(command->arg[1] >> 32);
+        st->height = (uint32_t)(command->arg[1] & 0xffffffff);
+        st->importSerial++;
+        if (ImportThread && ImportRunning && !(st->frameFlags & MPF_SharedMemory) && st->sharingKey[0] == 0)
+            QueueImport(st, fd);
+        TraceSpan("Update MPC_NewFrame", start, st->traceId, "pts", st->time);
+        //return true;
+    }
+    else if (command->cmd == MPC_MediaEnded)
+    {
+        if (!st->isLive)
+            st->time = st->duration;
+        st->endedCount++;
+    }
+    else if (command->cmd == MPC_MediaFailed)
+    {
+        st->isValid = false;
+        st->failedCount++;
+        return false;
+    }
+    else if (command->cmd == MPC_MediaChanged)
+    {
+        // mp switched to the next queued item without a gap
+        memset(st->visibleRect, 0, sizeof(st->visibleRect));
+        st->currentStream++;
+        st->keyframeCount = 0;
+        st->keyframeIndexComplete = false;
+        st->duration = command->arg[0];
+        st->width = (uint32_t)(command->arg[1] >> 32);
+        st->height = (uint32_t)(command->arg[1] & 0xffffffff);
+        st->openedCount++;
+    }
+    else if (command->cmd == MPC_Keyframe)
+    {
+        if (st->keyframeCount == st->keyframeCapacity)
+        {
+            st->keyframeCapacity = st->keyframeCapacity == 0 ? 256 : 2 * st->keyframeCapacity;
+            st->keyframes = (uint64_t*)realloc(st->keyframes, st->keyframeCapacity * sizeof(uint64_t));
+        }
+        st->keyframes[st->keyframeCount++] = command->arg[0];
+    }
+    else if (command->cmd == MPC_IndexReady)
+    {
+        st->keyframeIndexComplete = true;
+    }
+    else if (command->cmd == MPC_SeekCost)
+    {
+        st->seekCost = command->arg[1];
+    }
+    else if (command->cmd == MPC_VisibleRect)
+    {
+        st->visibleRect[0] = (uint32_t)(command->arg[0] >> 32);
+        st->visibleRect[1] = (uint32_t)(command->arg[0] & 0xffffffff);
+        st->visibleRect[2] = (uint32_t)(command->arg[1] >> 32);
+        st->visibleRect[3] = (uint32_t)(command->arg[1] & 0xffffffff);
+    }
+    else if (command->cmd == MPC_Buffering)
+    {
+        st->bufferingProgress = (float)command->arg[0] / 100.0f;
+    }
+    else if (command->cmd == MPC_MediaLoaded)
+    {
+        st->isValid = true;
+        st->lastDrawTime = MonotonicTime();
+        st->duration = command->arg[0];
+        st->width = (uint32_t)(command->arg[1] >> 32);
+        st->height = (uint32_t)(command->arg[1] & 0xffffffff);
+        st->openedCount++;
+    }
+
+    return true;
+}
+
+// Looping clips short and small enough for the cache, played by a single player on its own clock
+static bool CanCacheFrames(GstMediaPlayerState* st)
+{
+    return FrameCacheDuration != 0 && st->isValid && st->isLooping && !st->isLive && st->streamCount == 1 &&
+        st->duration <= FrameCacheDuration && st->syncGroup == 0 && st->sharingKey[0] == 0 && st->decoder == nullptr;
+}
+
+static void UpdateFrameCache(GstMediaPlayerState* st)
+{
+    if (st->cacheState == CacheOff && st->cacheCount == 0 && CanCacheFrames(st))
+        st->cacheState = CacheRecording;
+    else if ((st->cacheState == CacheRecording || st->cacheState == CacheComplete) && !CanCacheFrames(st))
+        st->cacheState = CacheOff;
+
+    if (st->cacheState == CacheComplete)
+    {
+        // The frame shown is the first one of the next loop, the clock starts from it
+        pthread_mutex_lock(&st->eventMutex);
+        if (st->fd != -1)
+        {
+            close(st->fd);
+            st->fd = -1;
+            AckUndrawnFrame(st, st->time);
+        }
+        RetirePreparedFrame(st->prepared, false);
+        st->cachePlaying = true;
+        st->cacheOrigin = MonotonicTime() - st->time;
+        st->cacheState = CacheReady;
+        pthread_mutex_unlock(&st->eventMutex);
+
+        MediaPlayerCommand command;
+        command.cmd = MPC_Suspend;
+        command.arg[0] = 0;
+        command.arg[1] = 0;
+        SendCommand(st, &command);
+        TraceInstant("frame cache ready", st->traceId, "pts", st->cacheCount);
+    }
+
+    if (st->cacheState == CacheReady)
+    {
+        uint64_t position = GetCachePosition(st, MonotonicTime());
+        uint32_t index = 0;
+        while (index + 1 < st->cacheCount && st->cacheFrames[index + 1].time <= position)
+            index++;
+
+        pthread_mutex_lock(&st->eventMutex);
+        st->cacheIndex = index;
+        st->time = st->cacheFrames[index].time;
+        PublishSnapshot(st);
+        pthread_mutex_unlock(&st->eventMutex);
+    }
+}
+
+extern "C" bool Update(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    if (st->decoder != nullptr)
+        return UpdateMember(st);
+
+    if (!st->pumpRunning)
+    {
+        pthread_mutex_lock(&st->eventMutex);
+        MediaPlayerCommand command;
+        int fd;
+        while (ReceiveCommand(st, &command, &fd) && HandleCommand(st, &command, fd))
+        {
+        }
+        PublishSnapshot(st);
+        pthread_mutex_unlock(&st->eventMutex);
+    }
+
+    // Callbacks always run here, on the thread calling Update
+    pthread_mutex_lock(&st->eventMutex);
+    uint32_t opened = st->openedCount;
+    uint32_t ended = st->endedCount;
+    uint32_t failed = st->failedCount;
+    pthread_mutex_unlock(&st->eventMutex);
+
+    if (st->reportedOpened != opened)
+    {
+        st->reportedOpened = opened;
+        st->mediaOpenedFn();
+    }
+
+    if (st->reportedEnded != ended)
+    {
+        st->reportedEnded = ended;
+        st->mediaEndedFn();
+    }
+
+    if (st->reportedFailed != failed)
+    {
+        st->reportedFailed = failed;
+        st->mediaFailedFn();
+        return false;
+    }
+
+    if (st->isValid)
+        UpdateQuality(st);
+
+    UpdateFrameCache(st);
+    UpdateBudget(MonotonicTime());
+
+    if (st->firstFence != st->lastFence)
+        AckFinishedFrames(st, false);
+
+    return true;
+}
+
+// Hands a member the current frame of its decoder. The one it didn't draw yet is superseded
+// Called with the member's eventMutex held, then the decoder's sharedMutex. RenderFrame draws and
+// closes the member's fd under the former
+static void GiveFrame(GstMediaPlayerState* decoder, GstMediaPlayerState* st)
+{
+    if (st->fd != -1)
+    {
+        close(st->fd);
+        ClearSharedHold(decoder, st->sharedBit, st->time, true);
+    }
+
+    st->fd = dup(decoder->sharedFd);
+    st->sharedSerial = decoder->sharedSerial;
+    st->frameArrival = decoder->frameArrival;
+    st->frameFlags = decoder->frameFlags;
+    st->frameLatency = decoder->frameLatency;
+    st->time = decoder->time;
+    st->width = decoder->width;
+    st->height = decoder->height;
+    memcpy(st->visibleRect, decoder->visibleRect, sizeof(st->visibleRect));
+    PublishSnapshot(st);
+
+    uint32_t newest = (decoder->lastShared + MaxSharedFrames - 1) % MaxSharedFrames;
+    if (decoder->firstShared != decoder->lastShared && decoder->sharedFrames[newest].time == st->time)
+        decoder->sharedFrames[newest].holders |= st->sharedBit;
+}
+
+// The frame that just arrived is handed to every member, the decoder never draws it
+static void ShareFrame(GstMediaPlayerState* decoder)
+{
+    pthread_mutex_lock(&decoder->eventMutex);
+    if (decoder->fd == -1)
+    {
+        pthread_mutex_unlock(&decoder->eventMutex);
+        return;
+    }
+
+    // Members are locked before sharedMutex, like RenderFrame does. Callers hold PlayersMutex
+    for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+    {
+        if (st->decoder == decoder)
+            pthread_mutex_lock(&st->eventMutex);
+    }
+    pthread_mutex_lock(&decoder->sharedMutex);
+
+    if (decoder->sharedFd != -1)
+        close(decoder->sharedFd);
+    decoder->sharedFd = decoder->fd;
+    decoder->fd = -1;
+    decoder->lastRenderTime = decoder->time;
+    decoder->sharedSerial++;
+    DestroySharedImage(decoder);
+
+    if ((decoder->lastShared + 1) % MaxSharedFrames == decoder->firstShared)
+        FlushSharedFrames(decoder, true);
+
+    SharedFrame& frame = decoder->sharedFrames[decoder->lastShared];
+    frame.time = decoder->time;
+    frame.holders = 0;
+    decoder->lastShared = (decoder->lastShared + 1) % MaxSharedFrames;
+
+    for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+    {
+        if (st->decoder == decoder)
+            GiveFrame(decoder, st);
+    }
+
+    FlushSharedFrames(decoder, false);
+    pthread_mutex_unlock(&decoder->sharedMutex);
+    for (GstMediaPlayerState* st = Players; st != nullptr; st = st->nextPlayer)
+    {
+        if (st->decoder == decoder)
+            pthread_mutex_unlock(&st->eventMutex);
+    }
+    pthread_mutex_unlock(&decoder->eventMutex);
+}
+
+// The decoder is updated from whichever member comes first. It is shown and drawn when any member
+// is, and delivers what the most demanding member asks for
+static bool UpdateMember(GstMediaPlayerState* st)
+{
+    GstMediaPlayerState* decoder = st->decoder;
+    Update(decoder);
+
+    pthread_mutex_lock(&PlayersMutex);
+    ShareFrame(decoder);
+
+    decoder->isVisible = false;
+    decoder->adaptiveQuality = false;
+    decoder->maxFrameRate = -1.0f;
+    for (GstMediaPlayerState* member = Players; member != nullptr; member = member->nextPlayer)
+    {
+        if (member->decoder != decoder)
+            continue;
+
+        decoder->isVisible |= member->isVisible;
+        decoder->adaptiveQuality |= member->adaptiveQuality;
+        if (member->lastDrawTime > decoder->lastDrawTime)
+            decoder->lastDrawTime = member->lastDrawTime;
+        if (member->maxFrameRate <= 0.0f || decoder->maxFrameRate == 0.0f)
+            decoder->maxFrameRate = 0.0f;
+        else if (member->maxFrameRate > decoder->maxFrameRate)
+            decoder->maxFrameRate = member->maxFrameRate;
+    }
+    pthread_mutex_unlock(&PlayersMutex);
+
+    st->isValid = decoder->isValid;
+    st->isLive = decoder->isLive;
+    st->duration = decoder->duration;
+    st->bufferingProgress = decoder->bufferingProgress;
+    st->keyframeIndexComplete = decoder->keyframeIndexComplete;
+    st->seekCost = decoder->seekCost;
+    st->sentQualityLevel = decoder->sentQualityLevel;
+    PublishSnapshot(st);
+
+    if (st->openedCount != decoder->openedCount)
+    {
+        st->openedCount = decoder->openedCount;
+        pthread_mutex_lock(&st->eventMutex);
+        if (st->fd == -1)
+        {
+            st->width = decoder->width;
+            st->height = decoder->height;
+            memcpy(st->visibleRect, decoder->visibleRect, sizeof(st->visibleRect));
+            PublishSnapshot(st);
+        }
+        pthread_mutex_unlock(&st->eventMutex);
+        st->mediaOpenedFn();
+    }
+
+    if (st->endedCount != decoder->endedCount)
+    {
+        st->endedCount = decoder->endedCount;
+        if (!st->isLive)
+        {
+            st->time = st->duration;
+            PublishSnapshot(st);
+        }
+        st->mediaEndedFn();
+    }
+
+    if (st->failedCount != decoder->failedCount)
+    {
+        st->failedCount = decoder->failedCount;
+        st->isValid = false;
+        st->mediaFailedFn();
+        return false;
+    }
+
+    if (st->firstFence != st->lastFence)
+        AckFinishedFrames(st, false);
+
+    return true;
+}
+
+// Draws still in flight finish first, then the member's holds are dropped
+static void DetachMember(GstMediaPlayerState* st)
+{
+    GstMediaPlayerState* decoder = st->decoder;
+
+    if (st->firstFence != st->lastFence)
+        AckFinishedFrames(st, true);
+
+    pthread_mutex_lock(&PlayersMutex);
+    pthread_mutex_lock(&st->eventMutex);
+    pthread_mutex_lock(&decoder->sharedMutex);
+    if (st->fd != -1)
+    {
+        close(st->fd);
+        st->fd = -1;
+    }
+    for (uint32_t i = decoder->firstShared; i != decoder->lastShared; i = (i + 1) % MaxSharedFrames)
+        decoder->sharedFrames[i].holders &= ~st->sharedBit;
+    FlushSharedFrames(decoder, false);
+    pthread_mutex_unlock(&decoder->sharedMutex);
+    pthread_mutex_unlock(&st->eventMutex);
+
+    decoder->members &= ~st->sharedBit;
+    bool last = decoder->members == 0;
+    pthread_mutex_unlock(&PlayersMutex);
+
+    if (last)
+        DestroyState(decoder);
+}
+
+static unsigned int IgnoreMediaEvent()
+{
+    return 0;
+}
+
+// Like OpenMedia, but players opened with the same key share one decoder: mp decodes each frame
+// once and every member draws the same dmabuf through the same EGLImage. A frame goes back to mp
+// once every member drew it or moved past it. Play, Pause, Seek and the other commands of any
+// member drive the shared decoder, while crop, readbacks and visibility stay per member. The
+// stream and its functions are only used when the key opens a new decoder and have to outlive
+// every member. A decoder that failed or has 32 members is not joined, GetSharedStream tells
+// which stream the member ended up reading
+extern "C" bool OpenSharedMedia(void* state, const char* sharingKey, const void* streamPtr, const char* streamName,
+    int64_t streamSize, ReadStream readFn, SeekStream seekFn, MediaOpened mediaOpenedFn, MediaEnded mediaEndedFn,
+    MediaFailed mediaFailedFn)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    st->mediaOpenedFn = mediaOpenedFn;
+    st->mediaEndedFn = mediaEndedFn;
+    st->mediaFailedFn = mediaFailedFn;
+
+    // Hidden from the caller, it goes away with its last member. Created up front because
+    // CreateState takes PlayersMutex, and destroyed unused when the key is found
+    GstMediaPlayerState* candidate = (GstMediaPlayerState*)CreateState();
+
+    // PlayersMutex is held from the lookup until the member bit is set, so the decoder can't lose
+    // its last member in between. A new decoder publishes its key before OpenMedia, later openers
+    // of the same key wait for it instead of opening their own
+    GstMediaPlayerState* decoder = nullptr;
+    pthread_mutex_lock(&PlayersMutex);
+    while (true)
+    {
+        decoder = nullptr;
+        for (GstMediaPlayerState* it = Players; it != nullptr; it = it->nextPlayer)
+        {
+            if (it->sharingKey[0] != 0 && strcmp(it->sharingKey, sharingKey) == 0 && it->failedCount == 0 &&
+                it->members != 0xffffffff)
+            {
+                decoder = it;
+                break;
+            }
+        }
+
+        // Looked up again once woken, a decoder that failed to open is gone by then
+        if (decoder == nullptr || !decoder->opening)
+            break;
+        pthread_cond_wait(&PlayersCond, &PlayersMutex);
+    }
+
+    if (decoder == nullptr)
+    {
+        decoder = candidate;
+        candidate = nullptr;
+        strncpy(decoder->sharingKey, sharingKey, sizeof(decoder->sharingKey) - 1);
+        decoder->opening = true;
+        pthread_mutex_unlock(&PlayersMutex);
+
+        decoder->inProcess = st->inProcess;
+        decoder->scheduling = st->scheduling;
+        decoder->eventPump = st->eventPump;
+        bool opened = OpenMedia(decoder, streamPtr, streamName, streamSize, readFn, seekFn, IgnoreMediaEvent,
+            IgnoreMediaEvent, IgnoreMediaEvent);
+
+        pthread_mutex_lock(&PlayersMutex);
+        decoder->opening = false;
+        if (!opened)
+            decoder->sharingKey[0] = 0;
+        pthread_cond_broadcast(&PlayersCond);
+
+        if (!opened)
+        {
+            pthread_mutex_unlock(&PlayersMutex);
+            DestroyState(decoder);
+            return false;
+        }
+    }
+
+    uint32_t bit = 1;
+    while ((decoder->members & bit) != 0)
+        bit <<= 1;
+    decoder->members |= bit;
+    st->decoder = decoder;
+    st->sharedBit = bit;
+    st->isLive = decoder->isLive;
+    st->bufferingProgress = decoder->bufferingProgress;
+
+    pthread_mutex_lock(&st->eventMutex);
+    pthread_mutex_lock(&decoder->sharedMutex);
+    if (decoder->sharedFd != -1)
+        GiveFrame(decoder, st);
+    pthread_mutex_unlock(&decoder->sharedMutex);
+    pthread_mutex_unlock(&st->eventMutex);
+    pthread_mutex_unlock(&PlayersMutex);
+
+    if (candidate != nullptr)
+        DestroyState(candidate);
+    return true;
+}
+
+// Stream the member's decoder was opened with, null when it is not a member
+extern "C" const void* GetSharedStream(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->decoder != nullptr ? st->decoder->streams[0] : nullptr;
+}
+
+// Pumped players bump it whenever a frame or an event arrives
+static pthread_mutex_t PumpMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PumpCond = PTHREAD_COND_INITIALIZER;
+static uint64_t PumpSerial = 0;
+static uint64_t WaitedSerial = 0;
+
+// Wakes up to see whether the pump is being stopped
+static const int PumpTimeout = 50;
+
+// Handles mp's commands as soon as they arrive, so frames and events don't wait for the UI to
+// render. The callbacks still run from Update, on the UI thread
+static void* EventPumpFunc(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    ApplyScheduling(&st->scheduling);
+
+    while (true)
+    {
+        if (st->channel != nullptr)
+        {
+            WaitCommand(&st->channel->toHost, PumpTimeout);
+        }
+        else
+        {
+            pollfd pfd;
+            pfd.fd = st->serverSocket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, PumpTimeout);
+        }
+
+        pthread_mutex_lock(&st->eventMutex);
+        if (st->pumpStop)
+        {
+            pthread_mutex_unlock(&st->eventMutex);
+            break;
+        }
+
+        bool handled = false;
+        MediaPlayerCommand command;
+        int fd;
+        while (ReceiveCommand(st, &command, &fd))
+        {
+            handled = true;
+            if (!HandleCommand(st, &command, fd))
+                break;
+        }
+        if (handled)
+            PublishSnapshot(st);
+        pthread_mutex_unlock(&st->eventMutex);
+
+        if (handled)
+        {
+            pthread_mutex_lock(&PumpMutex);
+            PumpSerial++;
+            pthread_cond_broadcast(&PumpCond);
+            pthread_mutex_unlock(&PumpMutex);
+        }
+    }
+    return nullptr;
+}
+
+static void StartEventPump(GstMediaPlayerState* st)
+{
+    if (st->pumpRunning)
+        return;
+
+    st->pumpStop = false;
+    pthread_create(&st->pumpThread, nullptr, EventPumpFunc, st);
+    st->pumpRunning = true;
+}
+
+static void StopEventPump(GstMediaPlayerState* st)
+{
+    if (!st->pumpRunning)
+        return;
+
+    pthread_mutex_lock(&st->eventMutex);
+    st->pumpStop = true;
+    pthread_mutex_unlock(&st->eventMutex);
+
+    pthread_join(st->pumpThread, nullptr);
+    st->pumpRunning = false;
+}
+
+extern "C" bool GetEventPump(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    return st->eventPump;
+}
+
+// Handles mp's commands on a thread of the player instead of in Update, and publishes time and
+// size as a consistent snapshot. Takes effect right away, or on OpenMedia. Defaults to MP_EVENT_PUMP
+extern "C" void SetEventPump(void* state, bool eventPump)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    st->eventPump = eventPump;
+
+    bool opened = st->channel != nullptr || st->serverSocket != -1;
+    if (eventPump && opened)
+        StartEventPump(st);
+    else if (!eventPump)
+        StopEventPump(st);
+}
+
+// Blocks until a pumped player received a frame or an event since the last call, or the timeout
+// expires. Returns false on timeout: nothing changed, the UI may skip rendering
+extern "C" bool WaitForEvents(uint32_t timeoutMs)
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    deadline.tv_sec += timeoutMs / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&PumpMutex);
+    while (PumpSerial == WaitedSerial)
+    {
+        if (pthread_cond_timedwait(&PumpCond, &PumpMutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    bool pumped = PumpSerial != WaitedSerial;
+    WaitedSerial = PumpSerial;
+    pthread_mutex_unlock(&PumpMutex);
+
+    return pumped;
+}
+
+extern "C" double GetFrameCacheDuration()
+{
+    return (double)FrameCacheDuration * 1e-9;
+}
+
+// Looping clips up to this long, in seconds, are decoded once and then played from textures with
+// mp suspended. 0 disables it. Defaults to MP_FRAME_CACHE_DURATION
+extern "C" void SetFrameCacheDuration(double duration)
+{
+    FrameCacheDuration = (uint64_t)(duration * 1e9);
+}
+
+extern "C" uint64_t GetFrameCacheSize()
+{
+    return FrameCacheSize;
+}
+
+// Most texture memory one cached clip may take, clips over it are played by mp as usual. Defaults
+// to MP_FRAME_CACHE_SIZE, in megabytes
+extern "C" void SetFrameCacheSize(uint64_t size)
+{
+    FrameCacheSize = size;
+}
+
+extern "C" bool GetIsFrameCached(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+
+    return st->cacheState == CacheReady;
+}
+
+static pthread_mutex_t ImportMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ImportCond = PTHREAD_COND_INITIALIZER;
+static GstMediaPlayerState* ImportQueue = nullptr;
+static GstMediaPlayerState* ImportCurrent = nullptr;
+static PreparedFrame* RetiredFrames = nullptr;
+static uint32_t RetiredCount = 0;
+static uint32_t RetiredCapacity = 0;
+static EGLDisplay ImportDisplay = EGL_NO_DISPLAY;
+static EGLContext ImportContext = EGL_NO_CONTEXT;
+static EGLSurface ImportSurface = EGL_NO_SURFACE;
+static pthread_t ImportWorker;
+static int ImportStatus = 0; // 1 when the worker made its context current, -1 when it could not
+static bool ImportStopping = false;
+
+// Hands the frame to the worker, destroyed there once the GPU is done with it. A drawn frame is
+// fenced on the render thread, one never drawn still holds the fence of its import
+static void RetirePreparedFrame(PreparedFrame& frame, bool drawn)
+{
+    if (frame.texture == 0)
+        return;
+
+    if (drawn && CreateSyncKHR != 0)
+    {
+        if (frame.sync != EGL_NO_SYNC_KHR)
+            DestroySyncKHR(ImportDisplay, frame.sync);
+        frame.sync = CreateSyncKHR(ImportDisplay, EGL_SYNC_FENCE_KHR, nullptr);
+        glFlush();
+    }
+
+    pthread_mutex_lock(&ImportMutex);
+    if (RetiredCount == RetiredCapacity)
+    {
+        RetiredCapacity = RetiredCapacity == 0 ? 16 : 2 * RetiredCapacity;
+        RetiredFrames = (PreparedFrame*)realloc(RetiredFrames, RetiredCapacity * sizeof(PreparedFrame));
+    }
+    RetiredFrames[RetiredCount++] = frame;
+    pthread_cond_broadcast(&ImportCond);
+    pthread_mutex_unlock(&ImportMutex);
+
+    frame.image = EGL_NO_IMAGE_KHR;
+    frame.texture = 0;
+    frame.sync = EGL_NO_SYNC_KHR;
+}
+
+// Called with the player's eventMutex held. A frame arriving before the worker took the previous
+// one replaces it
+static void QueueImport(GstMediaPlayerState* st, int fd)
+{
+    pthread_mutex_lock(&ImportMutex);
+    if (st->importJob.fd != -1)
+        close(st->importJob.fd);
+
+    st->importJob.fd = dup(fd);
+    st->importJob.serial = st->importSerial;
+    st->importJob.width = st->width;
+    st->importJob.height = st->height;
+    st->importJob.time = st->time;
+    st->importPending = st->importJob.fd != -1;
+
+    if (st->importPending && !st->importQueued)
+    {
+        st->nextImport = nullptr;
+        GstMediaPlayerState** link = &ImportQueue;
+        while (*link != nullptr)
+            link = &(*link)->nextImport;
+        *link = st;
+        st->importQueued = true;
+        pthread_cond_broadcast(&ImportCond);
+    }
+    pthread_mutex_unlock(&ImportMutex);
+}
+
+// Drops the player's queued frame and waits until the worker is done with it
+static void CancelImports(GstMediaPlayerState* st)
+{
+    pthread_mutex_lock(&ImportMutex);
+    if (st->importQueued)
+    {
+        GstMediaPlayerState** link = &ImportQueue;
+        while (*link != st)
+            link = &(*link)->nextImport;
+        *link = st->nextImport;
+        st->importQueued = false;
+    }
+    if (st->importJob.fd != -1)
+    {
+        close(st->importJob.fd);
+        st->importJob.fd = -1;
+    }
+    while (ImportCurrent == st)
+        pthread_cond_wait(&ImportCond, &ImportMutex);
+    st->importPending = false;
+    pthread_mutex_unlock(&ImportMutex);
+}
+
+static void DestroyRetiredFrame(PreparedFrame& frame)
+{
+    if (frame.sync != EGL_NO_SYNC_KHR)
+    {
+        ClientWaitSyncKHR(ImportDisplay, frame.sync, 0, EGL_FOREVER_KHR);
+        DestroySyncKHR(ImportDisplay, frame.sync);
+    }
+    glDeleteTextures(1, &frame.texture);
+    if (DestroyImageKHR(ImportDisplay, frame.image))
+        mLiveImages--;
+}
+
+// Import and texture setup are flushed here, so all the render thread does is bind the texture
+static PreparedFrame ImportFrame(const ImportJob& job, uint64_t traceId)
+{
+    uint64_t start = MonotonicTime();
+
+    PreparedFrame frame;
+    frame.serial = job.serial;
+    frame.texture = 0;
+    frame.sync = EGL_NO_SYNC_KHR;
+
+    EGLint attribs[19];
+    GetDmaBufAttribs(attribs, job.fd, job.width, job.height);
+    frame.image = CreateImageKHR(ImportDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    close(job.fd);
+    if (frame.image == EGL_NO_IMAGE_KHR)
+        return frame;
+    mLiveImages++;
+
+    glGenTextures(1, &frame.texture);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, frame.texture);
+    EGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frame.image);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+
+    if (CreateSyncKHR != 0)
+        frame.sync = CreateSyncKHR(ImportDisplay, EGL_SYNC_FENCE_KHR, nullptr);
+    if (frame.sync != EGL_NO_SYNC_KHR)
+        glFlush();
+    else
+        glFinish();
+
+    TraceSpan("EGLImage import", start, traceId, "pts", job.time);
+    return frame;
+}
+
+static void* ImportWorkerFunc(void*)
+{
+    bool current = eglMakeCurrent(ImportDisplay, ImportSurface, ImportSurface, ImportContext) == EGL_TRUE;
+
+    pthread_mutex_lock(&ImportMutex);
+    ImportStatus = current ? 1 : -1;
+    pthread_cond_broadcast(&ImportCond);
+    if (!current)
+    {
+        pthread_mutex_unlock(&ImportMutex);
+        return nullptr;
+    }
+
+    while (true)
+    {
+        while (ImportQueue == nullptr && RetiredCount == 0 && !ImportStopping)
+            pthread_cond_wait(&ImportCond, &ImportMutex);
+
+        // Destroying first keeps the images pinning mp's buffers to a minimum
+        while (RetiredCount != 0)
+        {
+            PreparedFrame frame = RetiredFrames[--RetiredCount];
+            pthread_mutex_unlock(&ImportMutex);
+            DestroyRetiredFrame(frame);
+            pthread_mutex_lock(&ImportMutex);
+        }
+
+        // Queued frames are left to CancelImports, the players import inline from now on
+        if (ImportStopping)
+            break;
+
+        GstMediaPlayerState* st = ImportQueue;
+        if (st == nullptr)
+            continue;
+
+        ImportQueue = st->nextImport;
+        st->importQueued = false;
+        ImportJob job = st->importJob;
+        st->importJob.fd = -1;
+        ImportCurrent = st;
+        pthread_mutex_unlock(&ImportMutex);
+
+        PreparedFrame frame = ImportFrame(job, st->traceId);
+
+        // A newer frame may have arrived meanwhile, it is queued already
+        pthread_mutex_lock(&st->eventMutex);
+        bool latest = job.serial == st->importSerial;
+        if (latest && frame.texture != 0)
+        {
+            RetirePreparedFrame(st->prepared, false);
+            st->prepared = frame;
+        }
+        else
+        {
+            RetirePreparedFrame(frame, false);
+        }
+        if (latest)
+            st->importPending = false;
+        pthread_mutex_unlock(&st->eventMutex);
+
+        pthread_mutex_lock(&ImportMutex);
+        ImportCurrent = nullptr;
+        pthread_cond_broadcast(&ImportCond);
+    }
+    pthread_mutex_unlock(&ImportMutex);
+
+    eglMakeCurrent(ImportDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    return nullptr;
+}
+
+// Creates the worker's context, sharing objects with the one current on the render thread. Without
+// EGL_KHR_wait_sync the render thread would have to block on each import, so it imports inline
+static void StartImportWorker()
+{
+    if (WaitSyncKHR == 0 || CreateSyncKHR == 0)
+        return;
+
+    EGLDisplay display = eglGetCurrentDisplay();
+    EGLContext context = eglGetCurrentContext();
+    if (display == EGL_NO_DISPLAY || context == EGL_NO_CONTEXT)
+        return;
+
+    EGLint configId = 0;
+    EGLint version = 2;
+    eglQueryContext(display, context, EGL_CONFIG_ID, &configId);
+    eglQueryContext(display, context, EGL_CONTEXT_CLIENT_VERSION, &version);
+
+    EGLint configAttribs[] = { EGL_CONFIG_ID, configId, EGL_NONE };
+    EGLConfig config;
+    EGLint count = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &count) || count == 0)
+        return;
+
+    EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, version, EGL_NONE };
+    ImportContext = eglCreateContext(display, config, context, contextAttribs);
+    if (ImportContext == EGL_NO_CONTEXT)
+        return;
+
+    // Nothing is drawn, a surface is only needed without EGL_KHR_surfaceless_context
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (extensions == nullptr || strstr(extensions, "EGL_KHR_surfaceless_context") == nullptr)
+    {
+        EGLint surfaceAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        ImportSurface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+        if (ImportSurface == EGL_NO_SURFACE)
+        {
+            eglDestroyContext(display, ImportContext);
+            ImportContext = EGL_NO_CONTEXT;
+            return;
+        }
+    }
+
+    ImportDisplay = display;
+
+    if (pthread_create(&ImportWorker, nullptr, ImportWorkerFunc, nullptr) != 0)
+        return;
+
+    pthread_mutex_lock(&ImportMutex);
+    while (ImportStatus == 0)
+        pthread_cond_wait(&ImportCond, &ImportMutex);
+    ImportRunning = ImportStatus == 1;
+    pthread_mutex_unlock(&ImportMutex);
+}
+
+// Joins the worker and destroys its context. Frames retired later are not destroyed anymore, so it
+// is only stopped once no player is left
+static void StopImportWorker()
+{
+    pthread_mutex_lock(&ImportMutex);
+    if (ImportStatus == 0)
+    {
+        pthread_mutex_unlock(&ImportMutex);
+        return;
+    }
+    ImportRunning = false;
+    ImportStopping = true;
+    pthread_cond_broadcast(&ImportCond);
+    pthread_mutex_unlock(&ImportMutex);
+
+    pthread_join(ImportWorker, nullptr);
+
+    if (ImportSurface != EGL_NO_SURFACE)
+        eglDestroySurface(ImportDisplay, ImportSurface);
+    eglDestroyContext(ImportDisplay, ImportContext);
+    ImportSurface = EGL_NO_SURFACE;
+    ImportContext = EGL_NO_CONTEXT;
+}
+
+extern "C" bool GetImportThread()
+{
+    return ImportThread;
+}
+
+// Imports dmabuf frames on a worker thread as soon as they arrive, RenderFrame then only binds a
+// texture that is ready. Needs EGL_KHR_wait_sync. The worker starts on the next RenderFrame and
+// stays until ShutdownMediaPlayer, turning it off only stops handing it frames. Defaults to
+// MP_IMPORT_THREAD
+extern "C" void SetImportThread(bool importThread)
+{
+    ImportThread = importThread;
+}
+
+extern "C" bool GetIoScheduler()
+{
+    return IoScheduler;
+}
+
+// Serves the stream reads of every player from one thread, most urgent first and in large blocks.
+// Applies to players opened afterwards. Defaults to MP_IO_SCHEDULER
+extern "C" void SetIoScheduler(bool ioScheduler)
+{
+    IoScheduler = ioScheduler;
+}
+
+extern "C" uint32_t GetIoBlockSize()
+{
+    return IoBlockSize;
+}
+
+// Bytes read from a stream at once by the scheduler. Defaults to MP_IO_BLOCK_SIZE, in kilobytes
+extern "C" void SetIoBlockSize(uint32_t blockSize)
+{
+    if (blockSize != 0)
+        IoBlockSize = blockSize;
+}
+
+// Bytes per second the scheduler read for the player lately, 0 when it stopped reading
+extern "C" double GetReadRate(void* state)
+{
+    GstMediaPlayerState* st = (GstMediaPlayerState*)state;
+    if (st->decoder != nullptr)
+        st = st->decoder;
+
+    if (MonotonicTime() - st->ioWindowStart >= 2 * IoRateWindow)
+        return 0.0;
+    return st->ioRate;
 }
@@ -0,0 +1,9 @@
+# Generates the benchmark clips in ./clips using software encoders
+mkdir -p clips
+for size in 320x240 1280x720 1920x1080; do
+    w=${size%x*}; h=${size#*x}
+    src="videotestsrc num-buffers=600 pattern=ball ! video/x-raw,width=$w,height=$h,framerate=30/1 ! videoconvert"
+    gst-launch-1.0 -q $src ! x264enc speed-preset=fast key-int-max=60 ! h264parse ! mp4mux ! filesink location=clips/h264_$size.mp4
+    gst-launch-1.0 -q $src ! vp8enc deadline=1 keyframe-max-dist=60 ! webmmux ! filesink location=clips/vp8_$size.webm
+    gst-launch-1.0 -q $src ! theoraenc keyframe-force=60 ! oggmux ! filesink location=clips/theora_$size.ogg
+done
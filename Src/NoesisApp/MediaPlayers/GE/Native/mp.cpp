@@ -20,13 +20,59 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/allocators/gstdmabuf.h>
+#include <gst/video/video.h>
 
 #include "MediaPlayerCommand.h"
+#include "Scheduling.h"
+#include "MediaPlayerChannel.h"
+#include "Trace.h"
+#include "ProbeCache.h"
 
-sockaddr_un serverSockaddr;
-int videoSocket;
-int64_t streamSize;
-GstElement* pipeline;
+struct Player;
+
+// One read channel into a libMediaPlayer stream. Reads carry their offset, so several readers can
+// share a stream and libMediaPlayer seeks the host stream whenever they interleave
+struct StreamReader
+{
+    Player* player;
+    int videoSocket;
+    uint32_t streamIndex;
+    uint64_t position;
+};
+
+// Keyframes of the current item, collected in the background by a parse-only pipeline that reads
+// the stream through its own StreamReader. Filled from a streaming thread, hence the mutex
+struct KeyframeIndex
+{
+    GstElement* pipeline;
+    StreamReader reader;
+    pthread_mutex_t mutex;
+    uint64_t* times;
+    uint64_t* offsets;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t sent;
+    gint64 status;
+};
+
+struct MediaPipeline
+{
+    Player* player;
+    GstElement* pipeline;
+    GstElement* source;
+    StreamReader reader;
+    KeyframeIndex index;
+    ProbeEntry* probe; // Hints from the probe cache, NULL when autoplugging from scratch
+    int64_t streamSize;
+    bool live; // Unknown size, read once from start to end and never sought
+    guint status; // Pending Status_* bits, set from the bus and the appsrc thread
+    guint busWatch;
+    gint64 pendingSeek;
+    bool seekInFlight;
+    uint64_t seekTime;
+};
+
+const uint MaxQueued = 16;
 
 struct frame
 {
@@ -35,17 +81,352 @@ struct frame
     GstBuffer* buffer;
     GstMapInfo map;
     int fd;
+    int fence;  // Signals when the GPU is done reading the frame, -1 when there is none
+    bool acked; // Drawn by libMediaPlayer, released once the fence signals
 };
 
 const uint MaxFrames = 64; // Way more than wee need so we don't have to bother checking for wraparound
-frame storedFrames[MaxFrames];
-uint firstFrame = 0;
-uint lastFrame = 0;
+
+// Everything a player needs, so several can run as threads inside libMediaPlayer
+struct Player
+{
+    // Process mode, talks to libMediaPlayer through the sockets in its tmp dir
+    sockaddr_un serverSockaddr;
+    sockaddr_un videoServerSockaddr;
+    int clientSocket;
+
+    // In-process mode, talks to libMediaPlayer through in-memory rings
+    EmbeddedChannel* channel;
+    GMainContext* context;
+    pthread_t thread;
+    int64_t streamSize;
+    char streamName[256];
+    bool quit;
+
+    uint64_t probeKey;
+    ProbeEntry probe;
+
+    int traceId;
+    ThreadScheduling scheduling;
+    double volume;
+    bool looping;
+
+    // Set by MPC_Quality when libMediaPlayer falls behind
+    uint32_t qualityLevel;
+    uint64_t throttleTime;
+
+    // Visible area of the frames last sent, from the decoder's crop meta
+    uint32_t visibleRect[4];
+
+    // Set by MPC_Latency, how far behind capture live frames are shown. 0 uses the lowest latency
+    // the pipeline reports
+    uint64_t latencyTarget;
+
+    // MPC_Suspend takes the pipelines to NULL and leaves the position in the current pendingSeek.
+    // resumeState is the state to return to, GST_STATE_VOID_PENDING while not suspended. Resuming
+    // drops the preroll at the start, then seeks and only then restores the state
+    bool suspended;
+    bool resuming;
+    GstState resumeState;
+
+    // Set by MPC_SyncClock. The pipeline runs on the monotonic system clock, the same in every mp
+    // process, and its base time is only ever set here: runningTime is where a paused pipeline
+    // stands and a start maps it to a clock time, so players started at the same clock time stay
+    // in step. startTime is a start waiting for a seek, 0 for as soon as it completes
+    bool syncClock;
+    GstClockTime runningTime;
+    GstClockTime seekStartTime;
+    GstClockTime startTime;
+    bool startPending;
+
+    // The current item plays in one pipeline while the next queued item prerolls in the other
+    MediaPipeline pipelines[2];
+    MediaPipeline* current;
+    MediaPipeline* standby;
+
+    // Stream index and size of items queued with MPC_Queue, waiting for the standby pipeline
+    uint64_t queuedItems[MaxQueued][2];
+    uint firstQueued;
+    uint lastQueued;
+
+    frame storedFrames[MaxFrames];
+    uint firstFrame;
+    uint lastFrame;
+};
+
+static void InitPlayer(Player* player)
+{
+    memset(player, 0, sizeof(Player));
+    player->clientSocket = -1;
+    player->traceId = getpid();
+    player->volume = -1.0;
+    player->scheduling.policy = InheritPolicy;
+    for (int i = 0; i < 2; i++)
+    {
+        player->pipelines[i].player = player;
+        player->pipelines[i].reader.player = player;
+        player->pipelines[i].reader.videoSocket = -1;
+        player->pipelines[i].index.reader.player = player;
+        player->pipelines[i].index.reader.videoSocket = -1;
+        pthread_mutex_init(&player->pipelines[i].index.mutex, nullptr);
+    }
+    player->current = &player->pipelines[0];
+}
+
+static void SendCommand(Player* player, MediaPlayerCommand* command)
+{
+    command->flags = 0;
+    command->stamp = MonotonicTime();
+    if (player->channel != NULL)
+        PushCommand(&player->channel->toHost, command, -1);
+    else
+        sendto(player->clientSocket, command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&player->serverSockaddr, sizeof(struct sockaddr_un));
+}
+
+// The fd stays owned by the frame ring and libMediaPlayer always receives its own duplicate, so a
+// frame released here after a seek is still valid until libMediaPlayer closes it
+static void SendFrame(Player* player, MediaPlayerCommand* command, int fd)
+{
+    if (player->channel != NULL)
+    {
+        int hostFd = dup(fd);
+        if (!PushCommand(&player->channel->toHost, command, hostFd))
+            close(hostFd);
+        return;
+    }
+
+    msghdr msg;
+    iovec iov;
+    cmsghdr *cmsg;
+    char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
+    memset(&msg, 0, sizeof(msghdr));
+    memset(&iov, 0, sizeof(iovec));
+    iov.iov_base = command;
+    iov.iov_len = sizeof(MediaPlayerCommand);
+    msg.msg_name = &player->serverSockaddr;
+    msg.msg_namelen = sizeof(sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buffer;
+    msg.msg_controllen = sizeof(cmsg_buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = sizeof(cmsg_buffer);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    *((int *)CMSG_DATA(cmsg)) = fd;
+    sendmsg(player->clientSocket, &msg, 0);
+}
+
+// Waits up to timeoutMs for the first command, then returns whatever else is pending. Only
+// MPC_FrameAck carries an fd, the fence of the drawn frame
+static bool ReceiveCommand(Player* player, MediaPlayerCommand* command, int* fd, int timeoutMs)
+{
+    *fd = -1;
+    if (player->channel != NULL)
+    {
+        if (timeoutMs > 0)
+            WaitCommand(&player->channel->toPlayer, timeoutMs);
+        return PopCommand(&player->channel->toPlayer, command, fd);
+    }
+
+    if (timeoutMs > 0)
+    {
+        pollfd fds;
+        fds.fd = player->clientSocket;
+        fds.events = POLLIN;
+        poll(&fds, 1, timeoutMs);
+    }
+
+    msghdr msg;
+    iovec iov;
+    cmsghdr *cmsg;
+    char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
+    memset(&msg, 0, sizeof(msghdr));
+    memset(&iov, 0, sizeof(iovec));
+    iov.iov_base = command;
+    iov.iov_len = sizeof(MediaPlayerCommand);
+    msg.msg_name = &player->serverSockaddr;
+    msg.msg_namelen = sizeof(sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buffer;
+    msg.msg_controllen = sizeof(cmsg_buffer);
+
+    if (recvmsg(player->clientSocket, &msg, MSG_DONTWAIT) == -1)
+        return false;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        *fd = *((int *)CMSG_DATA(cmsg));
+    return true;
+}
+
+static void SetBlocking(Player* player, bool blocking)
+{
+    if (player->channel != NULL)
+        return;
+
+    int flags = fcntl(player->clientSocket, F_GETFL, 0);
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    fcntl(player->clientSocket, F_SETFL, flags);
+}
+
+static void ReleaseFrame(frame& f)
+{
+    if (f.fence != -1)
+        close(f.fence);
+    close(f.fd);
+    gst_buffer_unmap (f.buffer, &f.map);
+    gst_sample_unref (f.sample);
+}
+
+// Releases without waiting for fences, the frames are not going to be shown anymore. With -1 every
+// frame is released
+static void ReleaseFrames(Player* player, gint64 untilTime)
+{
+    for (; player->firstFrame != player->lastFrame; player->firstFrame = (player->firstFrame + 1) % MaxFrames)
+    {
+        frame& f = player->storedFrames[player->firstFrame];
+        if (f.time == untilTime)
+            break;
+        ReleaseFrame(f);
+    }
+}
+
+// Hands acked frames back to the decoder in order, each as soon as its fence signals
+static void ReleaseAckedFrames(Player* player)
+{
+    for (; player->firstFrame != player->lastFrame; player->firstFrame = (player->firstFrame + 1) % MaxFrames)
+    {
+        frame& f = player->storedFrames[player->firstFrame];
+        if (!f.acked)
+            break;
+
+        if (f.fence != -1)
+        {
+            pollfd fds;
+            fds.fd = f.fence;
+            fds.events = POLLIN;
+            if (poll(&fds, 1, 0) == 0)
+                break;
+        }
+
+        TraceInstant("frame released", player->traceId, "pts", f.time);
+        ReleaseFrame(f);
+    }
+}
+
+// The GPU is done, or will be once the fence signals, with the acked frame and every frame before it.
+// Frames that were superseded before being drawn need no fence
+static void AckFrames(Player* player, gint64 time, int fence)
+{
+    for (uint i = player->firstFrame; i != player->lastFrame; i = (i + 1) % MaxFrames)
+    {
+        frame& f = player->storedFrames[i];
+        f.acked = true;
+        if (f.time == time)
+        {
+            if (f.fence != -1)
+                close(f.fence);
+            f.fence = fence;
+            fence = -1;
+            break;
+        }
+    }
+
+    if (fence != -1)
+        close(fence);
+
+    ReleaseAckedFrames(player);
+}
+
+// Software decoders hand out system memory, so the frame is copied into a memfd as tightly packed
+// NV12 that libMediaPlayer can upload itself. Only the visible area is copied, its size is
+// returned in width and height
+static int CopyToSharedMemory(GstSample* sample, GstBuffer* buffer, gint* width, gint* height)
+{
+    GstVideoInfo info;
+    if (!gst_video_info_from_caps(&info, gst_sample_get_caps(sample)))
+        return -1;
+
+    GstVideoFrame videoFrame;
+    if (!gst_video_frame_map(&videoFrame, &info, buffer, GST_MAP_READ))
+        return -1;
+
+    uint32_t frameWidth = GST_VIDEO_INFO_WIDTH(&info);
+    uint32_t frameHeight = GST_VIDEO_INFO_HEIGHT(&info);
+    uint32_t cropX = 0;
+    uint32_t cropY = 0;
+    uint32_t w = frameWidth;
+    uint32_t h = frameHeight;
+    GstVideoCropMeta* crop = gst_buffer_get_video_crop_meta(buffer);
+    if (crop != NULL && crop->x < frameWidth && crop->y < frameHeight)
+    {
+        cropX = crop->x;
+        cropY = crop->y;
+        w = crop->width < frameWidth - cropX ? crop->width : frameWidth - cropX;
+        h = crop->height < frameHeight - cropY ? crop->height : frameHeight - cropY;
+    }
+
+    // Chroma is subsampled, an odd origin starts at the sample covering it
+    uint32_t uvWidth = 2 * ((w + 1) / 2);
+    uint32_t uvHeight = (h + 1) / 2;
+    size_t size = w * h + uvWidth * uvHeight;
+
+    int fd = memfd_create("mp_frame", MFD_CLOEXEC);
+    if (fd != -1 && ftruncate(fd, size) == 0)
+    {
+        uint8_t* dst = (uint8_t*)mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+        if (dst != MAP_FAILED)
+        {
+            int yStride = GST_VIDEO_FRAME_PLANE_STRIDE(&videoFrame, 0);
+            const uint8_t* y = (const uint8_t*)GST_VIDEO_FRAME_PLANE_DATA(&videoFrame, 0) + cropY * yStride + cropX;
+            for (uint32_t row = 0; row < h; row++)
+                memcpy(dst + row * w, y + row * yStride, w);
+
+            int uvStride = GST_VIDEO_FRAME_PLANE_STRIDE(&videoFrame, 1);
+            const uint8_t* uv = (const uint8_t*)GST_VIDEO_FRAME_PLANE_DATA(&videoFrame, 1) + cropY / 2 * uvStride +
+                cropX / 2 * 2;
+            for (uint32_t row = 0; row < uvHeight; row++)
+                memcpy(dst + w * h + row * uvWidth, uv + row * uvStride, uvWidth);
+
+            munmap(dst, size);
+        }
+        else
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    gst_video_frame_unmap(&videoFrame);
+    *width = (gint)w;
+    *height = (gint)h;
+    return fd;
+}
 
 static GstFlowReturn Sample(GstElement* sink, void* data, const char* signal)
 {
-    uint idx = lastFrame;
-    lastFrame = (lastFrame + 1) % MaxFrames;
+    Player* player = ((MediaPipeline*)data)->player;
+    if (player->resuming)
+    {
+        GstSample* sample = NULL;
+        g_signal_emit_by_name (sink, signal, &sample);
+        if (sample != NULL)
+            gst_sample_unref (sample);
+        return GST_FLOW_OK;
+    }
+
+    frame* storedFrames = player->storedFrames;
+    uint idx = player->lastFrame;
+    storedFrames[idx].fence = -1;
+    storedFrames[idx].acked = false;
+    player->lastFrame = (player->lastFrame + 1) % MaxFrames;
 
     g_signal_emit_by_name (sink, signal, &storedFrames[idx].sample);
     if (storedFrames[idx].sample)
@@ -60,37 +441,69 @@ static GstFlowReturn Sample(GstElement* sink, void* data, const char* signal)
         storedFrames[idx].buffer = gst_sample_get_buffer(storedFrames[idx].sample);
         GstSegment* segment = gst_sample_get_segment(storedFrames[idx].sample);
         storedFrames[idx].time = storedFrames[idx].buffer->pts;
+        TraceInstant("appsink sample", player->traceId, "pts", storedFrames[idx].time);
         if (gst_buffer_map(storedFrames[idx].buffer, &storedFrames[idx].map, GST_MAP_READ))
         {
             GstMemory* mem = gst_buffer_peek_memory(storedFrames[idx].buffer, 0);
 
-            int gst_fd = gst_dmabuf_memory_get_fd(mem);
-            storedFrames[idx].fd = dup(gst_fd);
-            msghdr msg;
-            iovec iov;
-            cmsghdr *cmsg;
-            char cmsg_buffer[sizeof(cmsghdr) + sizeof(int)];
+            uint32_t frameFlags = 0;
+            uint32_t visibleRect[4] = { 0, 0, (uint32_t)width, (uint32_t)height };
+            if (gst_is_dmabuf_memory(mem))
+            {
+                int gst_fd = gst_dmabuf_memory_get_fd(mem);
+                storedFrames[idx].fd = dup(gst_fd);
+
+                // Decoders that pad their buffers describe the layout with a video meta and the
+                // picture inside it with a crop meta. The dimensions sent are the luma pitch and
+                // the rows up to the chroma plane, which is what the dmabuf import needs
+                GstVideoMeta* videoMeta = gst_buffer_get_video_meta(storedFrames[idx].buffer);
+                if (videoMeta != NULL && videoMeta->n_planes == 2 && videoMeta->stride[0] > 0 &&
+                    videoMeta->offset[1] % videoMeta->stride[0] == 0)
+                {
+                    width = videoMeta->stride[0];
+                    height = (gint)(videoMeta->offset[1] / videoMeta->stride[0]);
+                }
+
+                GstVideoCropMeta* crop = gst_buffer_get_video_crop_meta(storedFrames[idx].buffer);
+                if (crop != NULL)
+                {
+                    visibleRect[0] = crop->x;
+                    visibleRect[1] = crop->y;
+                    visibleRect[2] = crop->width;
+                    visibleRect[3] = crop->height;
+                }
+            }
+            else
+            {
+                // The copy holds just the visible area, so the whole of it is shown
+                storedFrames[idx].fd = CopyToSharedMemory(storedFrames[idx].sample, storedFrames[idx].buffer,
+                    &width, &height);
+                frameFlags = MPF_SharedMemory;
+                visibleRect[2] = (uint32_t)width;
+                visibleRect[3] = (uint32_t)height;
+            }
+
+            if (storedFrames[idx].fd == -1)
+                return GST_FLOW_OK;
+
             MediaPlayerCommand command;
+            if (memcmp(visibleRect, player->visibleRect, sizeof(visibleRect)) != 0)
+            {
+                memcpy(player->visibleRect, visibleRect, sizeof(visibleRect));
+                command.cmd = MPC_VisibleRect;
+                command.arg[0] = (((uint64_t)visibleRect[0]) << 32) | visibleRect[1];
+                command.arg[1] = (((uint64_t)visibleRect[2]) << 32) | visibleRect[3];
+                SendCommand(player, &command);
+            }
+
             command.cmd = MPC_NewFrame;
+            command.flags = frameFlags;
             command.arg[0] = storedFrames[idx].time;
             command.arg[1] = (((uint64_t)width) << 32) | height;
-            memset(&msg, 0, sizeof(msghdr));
-            memset(&iov, 0, sizeof(iovec));
-            iov.iov_base = &command;
-            iov.iov_len = sizeof(MediaPlayerCommand);
-            msg.msg_name = &serverSockaddr;
-            msg.msg_namelen = sizeof(sockaddr_un);
-            msg.msg_iov = &iov;
-            msg.msg_iovlen = 1;
-            msg.msg_control = cmsg_buffer;
-            msg.msg_controllen = sizeof(cmsg_buffer);
-            cmsg = CMSG_FIRSTHDR(&msg);
-            cmsg->cmsg_len = sizeof(cmsg_buffer);
-            cmsg->cmsg_level = SOL_SOCKET;
-            cmsg->cmsg_type = SCM_RIGHTS;
-            *((int *)CMSG_DATA(cmsg)) = storedFrames[idx].fd;
-            int clientSocket = *(int*)data;
-            sendmsg(clientSocket, &msg, 0);
+            command.stamp = MonotonicTime();
+            TraceFlow('s', command.stamp, player->traceId, storedFrames[idx].time);
+            SendFrame(player, &command, storedFrames[idx].fd);
+            TraceSpan("sendmsg MPC_NewFrame", command.stamp, player->traceId, "pts", storedFrames[idx].time);
         }
 
         return GST_FLOW_OK;
@@ -109,22 +522,120 @@ static GstFlowReturn NewPreroll(GstElement* sink, void* data)
     return Sample(sink, data, "pull-preroll");
 }
 
-static const gint64 Status_EOS = 1;
-static const gint64 Status_ERROR = 2;
-static const gint64 Status_READY = 3;
+static const guint Status_EOS = 1;
+static const guint Status_ERROR = 2;
+static const guint Status_SEGMENT_DONE = 4;
+
+static const uint64_t SeekTimeout = 5000000000ull;
+static const uint64_t KeyframeTolerance = 1000000ull;
+static const uint32_t MaxKeyframesPerUpdate = 64;
+static const guint IndexBlockSize = 256 * 1024;
+static const guint LiveBlockSize = 4096;
+static const guint LiveMaxBytes = 64 * 1024;
+static const uint64_t LiveMaxQueueTime = 200000000ull;
+static const uint64_t LiveStartTimeout = 10000000000ull;
+
+// While looping every seek is a segment seek, so the pipeline posts SEGMENT_DONE instead of EOS
+static GstSeekFlags SeekFlags(MediaPipeline* mp, GstSeekFlags flags)
+{
+    return mp->player->looping ? (GstSeekFlags)(flags | GST_SEEK_FLAG_SEGMENT) : flags;
+}
+
+// Latest keyframe at or before time. Fails while the index has not reached that far yet
+static bool FindKeyframe(KeyframeIndex* index, uint64_t time, uint64_t* keyframe)
+{
+    pthread_mutex_lock(&index->mutex);
+    bool found = index->count > 0 && index->times[0] <= time &&
+        (index->status == Status_EOS || index->times[index->count - 1] >= time);
+    if (found)
+    {
+        uint32_t first = 0;
+        uint32_t last = index->count;
+        while (last - first > 1)
+        {
+            uint32_t middle = (first + last) / 2;
+            if (index->times[middle] <= time)
+                first = middle;
+            else
+                last = middle;
+        }
+        *keyframe = index->times[first];
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return found;
+}
+
+// Only one flushing seek is in flight at a time. Newer targets overwrite the pending one and are
+// issued once ASYNC_DONE reports the previous seek complete, so rapid seeks never queue up
+static void IssueSeek(MediaPipeline* mp)
+{
+    if (mp->seekInFlight || mp->pendingSeek < 0)
+        return;
+
+    GstSeekFlags flags = (GstSeekFlags)(GST_SEEK_FLAG_ACCURATE | GST_SEEK_FLAG_FLUSH);
+
+    uint64_t keyframe;
+    if (FindKeyframe(&mp->index, mp->pendingSeek, &keyframe))
+    {
+        // A target on a keyframe needs no decode-forward, so the demuxer can take its keyframe path
+        if ((uint64_t)mp->pendingSeek - keyframe < KeyframeTolerance)
+            flags = (GstSeekFlags)(GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE | GST_SEEK_FLAG_FLUSH);
+
+        MediaPlayerCommand command;
+        command.cmd = MPC_SeekCost;
+        command.arg[0] = keyframe;
+        command.arg[1] = mp->pendingSeek - keyframe;
+        SendCommand(mp->player, &command);
+    }
+
+    Player* p = mp->player;
+    if (p->syncClock && mp == p->current)
+    {
+        // A flush while playing would keep the old base time, so the pipeline seeks paused and
+        // starts again once prerolled
+        if (GST_STATE_TARGET (mp->pipeline) == GST_STATE_PLAYING)
+        {
+            gst_element_set_state (mp->pipeline, GST_STATE_PAUSED);
+            p->startPending = true;
+            p->startTime = p->seekStartTime;
+        }
+        p->runningTime = 0;
+        p->seekStartTime = 0;
+    }
+
+    mp->seekInFlight = gst_element_seek_simple (mp->pipeline, GST_FORMAT_TIME, SeekFlags(mp, flags), mp->pendingSeek);
+    mp->seekTime = MonotonicTime();
+    mp->pendingSeek = -1;
+}
+
+// Wraps to the start with a non-flushing segment seek. The decoder is not flushed and the
+// demuxer keeps its state, so playback continues from the first frame without a hitch
+static void Loop(GstElement* pipeline)
+{
+    gst_element_seek (pipeline, 1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_SEGMENT, GST_SEEK_TYPE_SET, 0,
+        GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+}
 
 gboolean BusCall(GstBus* bus, GstMessage* msg, gpointer data)
 {
-    gint64* status = (gint64*) data;
+    MediaPipeline* mp = (MediaPipeline*)data;
+    GstElement* pipeline = mp->pipeline;
+    volatile guint* status = &mp->status;
     switch (GST_MESSAGE_TYPE (msg)) {
         case GST_MESSAGE_ASYNC_DONE:
         {
-            *status = Status_READY;
+            // Cleared right here, a terminal message right behind it must not delay this
+            mp->seekInFlight = false;
             break;
         }
         case GST_MESSAGE_EOS:
         {
-            *status = Status_EOS;
+            g_atomic_int_or(status, Status_EOS);
+            break;
+        }
+        case GST_MESSAGE_SEGMENT_DONE:
+        {
+            g_atomic_int_or(status, Status_SEGMENT_DONE);
             break;
         }
         case GST_MESSAGE_WARNING:
@@ -142,7 +653,7 @@ gboolean BusCall(GstBus* bus, GstMessage* msg, gpointer data)
         }
         case GST_MESSAGE_ERROR:
         {
-            *status = Status_ERROR;
+            g_atomic_int_or(status, Status_ERROR);
             GError *err;
             gchar *dbg;
             gst_message_parse_error (msg, &err, &dbg);
@@ -165,6 +676,14 @@ gboolean BusCall(GstBus* bus, GstMessage* msg, gpointer data)
         case GST_MESSAGE_BUFFERING:{
             gint percent;
             gst_message_parse_buffering (msg, &percent);
+            if (mp == mp->player->current)
+            {
+                MediaPlayerCommand command;
+                command.cmd = MPC_Buffering;
+                command.arg[0] = percent;
+                command.arg[1] = 0;
+                SendCommand(mp->player, &command);
+            }
             break;
         }
         case GST_MESSAGE_LATENCY:
@@ -186,28 +705,72 @@ gboolean BusCall(GstBus* bus, GstMessage* msg, gpointer data)
     return TRUE;
 }
 
+// In-process the host stream is read directly, otherwise libMediaPlayer relays it over videoSocket
+static ssize_t ReadData(StreamReader* reader, uint8_t* data, guint size)
+{
+    ssize_t read_size = 0;
+
+    EmbeddedChannel* channel = reader->player->channel;
+    if (channel != NULL && channel->readAtFn != NULL)
+    {
+        // Served along with every other player's reads, seeking included
+        read_size = channel->readAtFn(channel->host, reader->streamIndex % channel->maxStreams,
+            reader->position, data, size);
+    }
+    else if (channel != NULL)
+    {
+        uint32_t index = reader->streamIndex % channel->maxStreams;
+        const void* streamPtr = channel->streams[index];
+
+        pthread_mutex_lock(channel->streamMutex);
+        if (channel->streamPositions[index] != reader->position)
+            channel->seekFn(streamPtr, (unsigned int)reader->position);
+        while (read_size < size)
+        {
+            unsigned int s = channel->readFn(streamPtr, data + read_size, size - read_size);
+            if (s == 0)
+                break;
+            read_size += s;
+        }
+        channel->streamPositions[index] = reader->position + read_size;
+        pthread_mutex_unlock(channel->streamMutex);
+    }
+    else
+    {
+        int videoSocket = reader->videoSocket;
+
+        MediaPlayerCommand command;
+        memset(&command, 0, sizeof(MediaPlayerCommand));
+        command.cmd = MPC_Play;
+        command.arg[0] = size;
+        command.arg[1] = reader->position;
+        send(videoSocket, &command, sizeof(command), 0);
+
+        while (read_size < size)
+        {
+            ssize_t s = recv(videoSocket, data + read_size, size - read_size, 0);
+            if (s <= 0)
+                break;
+            read_size += s;
+        }
+    }
+
+    reader->position += read_size;
+    return read_size;
+}
+
 static void NeedData(GstElement* element, guint size, void* data)
 {
-    MediaPlayerCommand command;
-    command.cmd = MPC_Play;
-    command.arg[0] = size;
-    send(videoSocket, &command, sizeof(command), 0);
+    uint64_t start = MonotonicTime();
+    MediaPipeline* mp = (MediaPipeline*)data;
 
-    gint64* status = (gint64*)data;
     GstBuffer* buffer = gst_buffer_new();
     GstMemory* memory = gst_allocator_alloc(NULL, size, NULL);
     gst_buffer_insert_memory (buffer, -1, memory);
 
     GstMapInfo map;
     gst_memory_map(memory, &map, GST_MAP_WRITE);
-    ssize_t read_size = recv(videoSocket, map.data, size, 0);
-    while (read_size < size)
-    {
-        ssize_t s = recv(videoSocket, map.data + read_size, size - read_size, 0);
-        read_size += s;
-        if (s <= 0)
-            break;
-    }
+    ssize_t read_size = ReadData(&mp->reader, map.data, size);
     gst_memory_unmap(memory, &map);
 
     GstFlowReturn ret;
@@ -215,7 +778,7 @@ static void NeedData(GstElement* element, guint size, void* data)
   
     if (ret != GST_FLOW_OK)
     {
-        *status = Status_ERROR;
+        g_atomic_int_or(&mp->status, Status_ERROR);
     }
   
     if (read_size != size)
@@ -226,115 +789,539 @@ static void NeedData(GstElement* element, guint size, void* data)
     }
 
     gst_buffer_unref(buffer);
+
+    TraceSpan("need-data", start, mp->player->traceId, "size", size);
 }
 
+// Only moves the reader, the next read tells libMediaPlayer where to read from
 static gboolean SeekData(GstElement* element, guint64 offset, void* data)
 {
-    MediaPlayerCommand command;
-    command.cmd = MPC_Seek;
-    command.arg[0] = offset;
-    send(videoSocket, &command, sizeof(command), 0);
+    ((MediaPipeline*)data)->reader.position = offset;
     return TRUE;
 }
 
-GstElement *source;
-
 static void SourceSetup(GstElement *pipeline, GstElement *src, gpointer data)
 {
-    source = src;
-    g_object_set (source, "size", streamSize, NULL);
+    MediaPipeline* mp = (MediaPipeline*)data;
+    GstElement* source = src;
+    mp->source = src;
+    if (mp->probe != NULL && mp->probe->container[0] != 0)
+    {
+        // Known container, typefind takes the caps as they are instead of reading the stream
+        GstCaps* caps = gst_caps_from_string (mp->probe->container);
+        if (caps != NULL)
+        {
+            g_object_set (source, "caps", caps, NULL);
+            gst_caps_unref (caps);
+        }
+    }
+    if (mp->live)
+    {
+        // Small blocks and a bounded queue so data is pushed as soon as it arrives
+        g_object_set (source, "stream-type", GST_APP_STREAM_TYPE_STREAM, NULL);
+        g_object_set (source, "is-live", TRUE, NULL);
+        g_object_set (source, "do-timestamp", TRUE, NULL);
+        g_object_set (source, "blocksize", LiveBlockSize, NULL);
+        g_object_set (source, "max-bytes", (guint64)LiveMaxBytes, NULL);
+        g_object_set (source, "emit-signals", TRUE, NULL);
+        g_signal_connect (source, "need-data", G_CALLBACK (NeedData), data);
+        return;
+    }
+    g_object_set (source, "size", mp->streamSize, NULL);
     g_object_set (source, "stream-type", GST_APP_STREAM_TYPE_RANDOM_ACCESS, NULL);
     g_object_set (source, "emit-signals", TRUE, NULL);
     g_signal_connect (source, "need-data", G_CALLBACK (NeedData), data);
     g_signal_connect (source, "seek-data", G_CALLBACK (SeekData), data);
 }
 
-static void VideoChanged(GstElement * playbin, gpointer udata)
+// Mirrors decodebin's enum, which is not part of the public headers
+typedef enum
 {
+    GST_AUTOPLUG_SELECT_TRY,
+    GST_AUTOPLUG_SELECT_EXPOSE,
+    GST_AUTOPLUG_SELECT_SKIP
+} GstAutoplugSelectResult;
+
+static const char* ProbeFactory(ProbeEntry* probe, const gchar* klass)
+{
+    if (klass == NULL)
+        return NULL;
+    if (strstr(klass, "Demuxer") != NULL)
+        return probe->demuxer;
+    if (strstr(klass, "Video") == NULL)
+        return NULL;
+    if (strstr(klass, "Parser") != NULL)
+        return probe->parser;
+    if (strstr(klass, "Decoder") != NULL)
+        return probe->decoder;
+    return NULL;
 }
 
-void SignalHandler(int)
+// Only lets through the demuxer, parser and decoder that worked last time, so decodebin does not
+// try candidates by rank
+static GstAutoplugSelectResult AutoplugSelect(GstElement* bin, GstPad* pad, GstCaps* caps,
+    GstElementFactory* factory, gpointer data)
 {
-    exit(0);
+    ProbeEntry* probe = (ProbeEntry*)data;
+    const gchar* klass = gst_element_factory_get_metadata (factory, GST_ELEMENT_METADATA_KLASS);
+    const char* cached = ProbeFactory(probe, klass);
+    if (cached != NULL && cached[0] != 0 && strcmp(cached, gst_plugin_feature_get_name (factory)) != 0)
+        return GST_AUTOPLUG_SELECT_SKIP;
+    return GST_AUTOPLUG_SELECT_TRY;
 }
 
-int main(int argc, char** argv)
+static void ElementSetup(GstElement* playbin, GstElement* element, gpointer data)
 {
-    if (argc != 3)
+    MediaPipeline* mp = (MediaPipeline*)data;
+    GstElementFactory* factory = gst_element_get_factory (element);
+    if (factory == NULL || strcmp(gst_plugin_feature_get_name (factory), "decodebin") != 0)
+        return;
+
+    if (mp->probe != NULL)
+        g_signal_connect (element, "autoplug-select", G_CALLBACK (AutoplugSelect), mp->probe);
+
+    if (mp->live)
     {
-        exit(-1);
+        // Bounds the demuxed queues to the latency target and makes them post BUFFERING with
+        // their fill level
+        guint64 maxTime = mp->player->latencyTarget != 0 ? mp->player->latencyTarget : LiveMaxQueueTime;
+        g_object_set (element, "use-buffering", TRUE, "max-size-time", maxTime, "max-size-bytes", 0,
+            "max-size-buffers", 0, NULL);
     }
+}
 
-    signal(SIGTERM, &SignalHandler);
+static void VideoChanged(GstElement * playbin, gpointer udata)
+{
+}
 
-    const char* tmpDir = argv[1];
-    const char* streamSizeStr = argv[2];
-    streamSize = atoll(streamSizeStr);
-    
-    int clientSocket = socket(AF_UNIX, SOCK_DGRAM, 0);
-    
-    char clientSocketPath[256];
-    strcpy(clientSocketPath, tmpDir);
-    strcat(clientSocketPath, "/client_socket");
+static void ConnectStream(StreamReader* reader, uint32_t streamIndex)
+{
+    reader->streamIndex = streamIndex;
+    reader->position = 0;
+    if (reader->videoSocket != -1)
+        close(reader->videoSocket);
+    reader->videoSocket = -1;
 
-    sockaddr_un clientSockaddr;
-    memset(&clientSockaddr, 0, sizeof(sockaddr_un));
-    clientSockaddr.sun_family = AF_UNIX;        
-    strcpy(clientSockaddr.sun_path, clientSocketPath);
-    unlink(clientSocketPath);
-    bind(clientSocket, (sockaddr*)&clientSockaddr, sizeof(sockaddr_un));
-    
-    char serverSocketPath[256];
-    strcpy(serverSocketPath, tmpDir);
-    strcat(serverSocketPath, "/server_socket");
+    if (reader->player->channel != NULL)
+        return;
 
-    memset(&serverSockaddr, 0, sizeof(sockaddr_un));
-    serverSockaddr.sun_family = AF_UNIX;        
-    strcpy(serverSockaddr.sun_path, serverSocketPath);
-    
-    char videoServerSocketPath[256];
-    strcpy(videoServerSocketPath, tmpDir);
-    strcat(videoServerSocketPath, "/video_socket");
-    
-    sockaddr_un videoServerSockaddr;
-    memset(&videoServerSockaddr, 0, sizeof(sockaddr_un));
-    videoServerSockaddr.sun_family = AF_UNIX;        
-    strcpy(videoServerSockaddr.sun_path, videoServerSocketPath);
-    
-    videoSocket = socket(AF_UNIX, SOCK_STREAM, 0);
-    connect(videoSocket, (sockaddr*)&videoServerSockaddr, sizeof(sockaddr_un));
+    reader->videoSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    connect(reader->videoSocket, (sockaddr*)&reader->player->videoServerSockaddr, sizeof(sockaddr_un));
 
-    gst_init(NULL, NULL);
+    // Tells libMediaPlayer which of its streams this channel reads from
+    MediaPlayerCommand command;
+    memset(&command, 0, sizeof(MediaPlayerCommand));
+    command.cmd = MPC_StreamChannel;
+    command.arg[0] = streamIndex;
+    send(reader->videoSocket, &command, sizeof(command), 0);
+}
 
-    const gchar* descr = "playbin uri=appsrc:// video-sink=\"appsink name=sink\"";
-    GError *error = NULL;
-    pipeline = gst_parse_launch (descr, &error);
-    
-    gint64 status = 0;
-    g_signal_connect (pipeline, "source-setup", G_CALLBACK (SourceSetup), &status);
-    g_signal_connect (pipeline, "video-changed", G_CALLBACK (VideoChanged), &status);
+static void CloseStream(StreamReader* reader)
+{
+    if (reader->videoSocket != -1)
+        close(reader->videoSocket);
+    reader->videoSocket = -1;
+}
 
-    GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE (pipeline));
-    int bus_watch_id = gst_bus_add_watch (bus, BusCall, &status);
-    gst_object_unref (bus);
+static void IndexNeedData(GstElement* element, guint size, void* data)
+{
+    KeyframeIndex* index = (KeyframeIndex*)data;
 
-    gst_element_set_state (pipeline, GST_STATE_PAUSED);
+    GstBuffer* buffer = gst_buffer_new();
+    GstMemory* memory = gst_allocator_alloc(NULL, size, NULL);
+    gst_buffer_insert_memory (buffer, -1, memory);
 
-    // Wait for the pipeline to preroll
-    gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+    GstMapInfo map;
+    gst_memory_map(memory, &map, GST_MAP_WRITE);
+    ssize_t read_size = ReadData(&index->reader, map.data, size);
+    gst_memory_unmap(memory, &map);
+    gst_buffer_set_size(buffer, read_size > 0 ? read_size : 0);
 
-    GstElement* sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
-    g_object_set (sink, "emit-signals", TRUE, NULL);
-    g_signal_connect (sink, "new-sample", G_CALLBACK (NewSample), &clientSocket);
-    g_signal_connect (sink, "new-preroll", G_CALLBACK (NewPreroll), &clientSocket);
-    gst_object_unref(sink);
+    GstFlowReturn ret;
+    g_signal_emit_by_name(element, "push-buffer", buffer, &ret);
+    if (read_size != size)
+        gst_app_src_end_of_stream(GST_APP_SRC(element));
 
-    gint64 dimensions = 0;    
-    GstPad *videopad = NULL;
-    g_signal_emit_by_name (pipeline, "get-video-pad", 0, &videopad); 
-    GstCaps *caps;
-    if ((caps = gst_pad_get_current_caps (videopad)))
-    {
+    gst_buffer_unref(buffer);
+}
+
+static gboolean IndexSeekData(GstElement* element, guint64 offset, void* data)
+{
+    ((KeyframeIndex*)data)->reader.position = offset;
+    return TRUE;
+}
+
+// Buffers coming out of the parser carry the demuxer flags, so every one without DELTA_UNIT is a
+// keyframe. The byte offset is the demuxer's when it sets one, otherwise how far the index had
+// read, which is an upper bound
+static GstPadProbeReturn IndexProbe(GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+    KeyframeIndex* index = (KeyframeIndex*)data;
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)))
+        return GST_PAD_PROBE_OK;
+
+    pthread_mutex_lock(&index->mutex);
+    if (index->count == index->capacity)
+    {
+        index->capacity = index->capacity == 0 ? 256 : 2 * index->capacity;
+        index->times = (uint64_t*)realloc(index->times, index->capacity * sizeof(uint64_t));
+        index->offsets = (uint64_t*)realloc(index->offsets, index->capacity * sizeof(uint64_t));
+    }
+    index->times[index->count] = GST_BUFFER_PTS(buffer);
+    index->offsets[index->count] = GST_BUFFER_OFFSET(buffer) != GST_BUFFER_OFFSET_NONE ?
+        GST_BUFFER_OFFSET(buffer) : index->reader.position;
+    index->count++;
+    pthread_mutex_unlock(&index->mutex);
+
+    return GST_PAD_PROBE_OK;
+}
+
+// Every parsed stream is drained into a fakesink, only video streams are indexed
+static void IndexPadAdded(GstElement* parser, GstPad* pad, gpointer data)
+{
+    KeyframeIndex* index = (KeyframeIndex*)data;
+
+    GstElement* sink = gst_element_factory_make ("fakesink", NULL);
+    g_object_set (sink, "sync", FALSE, "async", FALSE, NULL);
+    gst_bin_add (GST_BIN (index->pipeline), sink);
+    gst_element_sync_state_with_parent (sink);
+
+    GstPad* sinkPad = gst_element_get_static_pad (sink, "sink");
+    gst_pad_link (pad, sinkPad);
+    gst_object_unref (sinkPad);
+
+    GstCaps* caps = gst_pad_query_caps (pad, NULL);
+    if (caps != NULL)
+    {
+        if (g_str_has_prefix (gst_structure_get_name (gst_caps_get_structure (caps, 0)), "video/"))
+            gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, IndexProbe, index, NULL);
+        gst_caps_unref (caps);
+    }
+}
+
+static gboolean IndexBusCall(GstBus* bus, GstMessage* msg, gpointer data)
+{
+    KeyframeIndex* index = (KeyframeIndex*)data;
+    if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS)
+        index->status = Status_EOS;
+    else if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR)
+        index->status = Status_ERROR;
+    return TRUE;
+}
+
+static void StopIndex(KeyframeIndex* index)
+{
+    if (index->pipeline == NULL)
+        return;
+
+    gst_element_set_state (index->pipeline, GST_STATE_NULL);
+    GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE (index->pipeline));
+    gst_bus_remove_watch (bus);
+    gst_object_unref (bus);
+    gst_object_unref (index->pipeline);
+    index->pipeline = NULL;
+    CloseStream(&index->reader);
+}
+
+static void ClearIndex(KeyframeIndex* index)
+{
+    StopIndex(index);
+
+    pthread_mutex_lock(&index->mutex);
+    free(index->times);
+    free(index->offsets);
+    index->times = NULL;
+    index->offsets = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->sent = 0;
+    index->status = 0;
+    pthread_mutex_unlock(&index->mutex);
+}
+
+// Streaming threads post STREAM_STATUS from the thread itself when they start. mp inherits its
+// placement from the host at fork, but in-process the threads may be spawned from any host thread
+static GstBusSyncReply StreamStatus(GstBus* bus, GstMessage* msg, gpointer data)
+{
+    Player* p = (Player*)data;
+
+    if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_STREAM_STATUS)
+    {
+        GstStreamStatusType type;
+        GstElement* owner;
+        gst_message_parse_stream_status (msg, &type, &owner);
+        if (type == GST_STREAM_STATUS_TYPE_ENTER)
+            ApplyScheduling(&p->scheduling);
+    }
+
+    return GST_BUS_PASS;
+}
+
+static void PlaceThreads(Player* p, GstBus* bus)
+{
+    if (p->scheduling.cpuMask != 0 || p->scheduling.policy != InheritPolicy)
+        gst_bus_set_sync_handler (bus, StreamStatus, p, NULL);
+}
+
+// Indexing starts once the item is loaded so it never delays the first frame. Parsing without
+// decoding is cheap, the cost is reading the stream a second time in large blocks
+static void StartIndex(MediaPipeline* mp)
+{
+    KeyframeIndex* index = &mp->index;
+    ClearIndex(index);
+
+    GError *error = NULL;
+    index->pipeline = gst_parse_launch ("appsrc name=src ! parsebin name=parser", &error);
+    if (index->pipeline == NULL)
+    {
+        g_clear_error (&error);
+        index->status = Status_ERROR;
+        return;
+    }
+
+    ConnectStream(&index->reader, mp->reader.streamIndex);
+
+    GstElement* source = gst_bin_get_by_name (GST_BIN (index->pipeline), "src");
+    g_object_set (source, "size", mp->streamSize, NULL);
+    g_object_set (source, "stream-type", GST_APP_STREAM_TYPE_RANDOM_ACCESS, NULL);
+    g_object_set (source, "blocksize", IndexBlockSize, NULL);
+    g_object_set (source, "emit-signals", TRUE, NULL);
+    g_signal_connect (source, "need-data", G_CALLBACK (IndexNeedData), index);
+    g_signal_connect (source, "seek-data", G_CALLBACK (IndexSeekData), index);
+    gst_object_unref (source);
+
+    GstElement* parser = gst_bin_get_by_name (GST_BIN (index->pipeline), "parser");
+    g_signal_connect (parser, "pad-added", G_CALLBACK (IndexPadAdded), index);
+    gst_object_unref (parser);
+
+    GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE (index->pipeline));
+    gst_bus_add_watch (bus, IndexBusCall, index);
+    PlaceThreads(mp->player, bus);
+    gst_object_unref (bus);
+
+    gst_element_set_state (index->pipeline, GST_STATE_PLAYING);
+}
+
+// Forwards new keyframes a batch at a time so the datagram socket never overflows, and tears the
+// index pipeline down once it is complete
+static void SendKeyframes(Player* player, KeyframeIndex* index)
+{
+    MediaPlayerCommand command;
+    uint32_t batch = 0;
+
+    pthread_mutex_lock(&index->mutex);
+    for (; index->sent < index->count && batch < MaxKeyframesPerUpdate; index->sent++, batch++)
+    {
+        command.cmd = MPC_Keyframe;
+        command.arg[0] = index->times[index->sent];
+        command.arg[1] = index->offsets[index->sent];
+        SendCommand(player, &command);
+    }
+    bool done = index->sent == index->count && index->status != 0;
+    pthread_mutex_unlock(&index->mutex);
+
+    if (done && index->pipeline != NULL)
+    {
+        StopIndex(index);
+
+        if (index->status == Status_EOS)
+        {
+            command.cmd = MPC_IndexReady;
+            command.arg[0] = index->count;
+            command.arg[1] = 0;
+            SendCommand(player, &command);
+        }
+    }
+}
+
+// Lets decoders hand out padded buffers and crop through metas instead of copying the picture
+static GstPadProbeReturn AllocationProbe(GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+    GstQuery* query = GST_PAD_PROBE_INFO_QUERY (info);
+    if (GST_QUERY_TYPE (query) == GST_QUERY_ALLOCATION)
+    {
+        if (!gst_query_find_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL))
+            gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+        if (!gst_query_find_allocation_meta (query, GST_VIDEO_CROP_META_API_TYPE, NULL))
+            gst_query_add_allocation_meta (query, GST_VIDEO_CROP_META_API_TYPE, NULL);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void UseSharedClock(MediaPipeline* mp, bool enable)
+{
+    if (enable)
+    {
+        GstClock* clock = gst_system_clock_obtain ();
+        g_object_set (clock, "clock-type", GST_CLOCK_TYPE_MONOTONIC, NULL);
+        gst_pipeline_use_clock (GST_PIPELINE (mp->pipeline), clock);
+        gst_object_unref (clock);
+        gst_element_set_start_time (mp->pipeline, GST_CLOCK_TIME_NONE);
+    }
+    else
+    {
+        gst_pipeline_auto_clock (GST_PIPELINE (mp->pipeline));
+        gst_element_set_start_time (mp->pipeline, 0);
+    }
+}
+
+// With the shared clock the running time the pipeline stands at is shown at startTime, 0 for now
+static void PlayAt(MediaPipeline* mp, GstClockTime startTime)
+{
+    Player* p = mp->player;
+    if (p->syncClock)
+    {
+        if (startTime == 0)
+            startTime = MonotonicTime();
+        gst_element_set_base_time (mp->pipeline, startTime - p->runningTime);
+    }
+    gst_element_set_state (mp->pipeline, GST_STATE_PLAYING);
+}
+
+// Remembers the running time reached at pauseTime, 0 for now. Players paused at the same clock
+// time keep the same running time
+static void PauseAt(MediaPipeline* mp, GstClockTime pauseTime)
+{
+    Player* p = mp->player;
+    if (p->syncClock)
+    {
+        p->startPending = false;
+        if (GST_STATE_TARGET (mp->pipeline) == GST_STATE_PLAYING)
+        {
+            if (pauseTime == 0)
+                pauseTime = MonotonicTime();
+            GstClockTime baseTime = gst_element_get_base_time (mp->pipeline);
+            p->runningTime = pauseTime > baseTime ? pauseTime - baseTime : 0;
+        }
+    }
+    gst_element_set_state (mp->pipeline, GST_STATE_PAUSED);
+}
+
+static void CreatePipeline(MediaPipeline* mp, uint32_t streamIndex, int64_t streamSize, ProbeEntry* probe)
+{
+    mp->probe = probe;
+    mp->streamSize = streamSize;
+    mp->live = streamSize < 0;
+    mp->source = NULL;
+    g_atomic_int_set(&mp->status, 0);
+    mp->pendingSeek = -1;
+    mp->seekInFlight = false;
+    ConnectStream(&mp->reader, streamIndex);
+
+    const gchar* descr = "playbin uri=appsrc:// video-sink=\"appsink name=sink\"";
+    GError *error = NULL;
+    mp->pipeline = gst_parse_launch (descr, &error);
+
+    // The renderer only understands NV12, either as a dmabuf or as system memory
+    GstElement* videoSink = NULL;
+    g_object_get (mp->pipeline, "video-sink", &videoSink, NULL);
+    GstCaps* sinkCaps = gst_caps_from_string ("video/x-raw(memory:DMABuf),format=NV12;video/x-raw,format=NV12");
+    g_object_set (videoSink, "caps", sinkCaps, NULL);
+    gst_caps_unref (sinkCaps);
+    GstPad* sinkPad = gst_element_get_static_pad (videoSink, "sink");
+    gst_pad_add_probe (sinkPad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM, AllocationProbe, NULL, NULL);
+    gst_object_unref (sinkPad);
+    if (mp->live)
+    {
+        // Live frames keep coming before the host is ready, only the newest one is worth keeping
+        g_object_set (videoSink, "max-buffers", 1, "drop", TRUE, NULL);
+    }
+    gst_object_unref (videoSink);
+
+    g_signal_connect (mp->pipeline, "source-setup", G_CALLBACK (SourceSetup), mp);
+    g_signal_connect (mp->pipeline, "video-changed", G_CALLBACK (VideoChanged), mp);
+    g_signal_connect (mp->pipeline, "element-setup", G_CALLBACK (ElementSetup), mp);
+
+    GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE (mp->pipeline));
+    mp->busWatch = gst_bus_add_watch (bus, BusCall, mp);
+    PlaceThreads(mp->player, bus);
+    gst_object_unref (bus);
+
+    if (mp->player->volume >= 0.0)
+        g_object_set (mp->pipeline, "volume", mp->player->volume, NULL);
+
+    if (mp->live && mp->player->latencyTarget != 0)
+        gst_pipeline_set_latency (GST_PIPELINE (mp->pipeline), mp->player->latencyTarget);
+
+    if (mp->player->syncClock)
+        UseSharedClock(mp, true);
+
+    gst_element_set_state (mp->pipeline, GST_STATE_PAUSED);
+}
+
+static void DestroyPipeline(MediaPipeline* mp)
+{
+    gst_element_set_state (mp->pipeline, GST_STATE_NULL);
+    GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE (mp->pipeline));
+    gst_bus_remove_watch (bus);
+    gst_object_unref (bus);
+    gst_object_unref (mp->pipeline);
+    CloseStream(&mp->reader);
+    ClearIndex(&mp->index);
+    mp->pipeline = NULL;
+}
+
+// Level 1 lets late frames be dropped through QoS and skips B-frames, level 2 also decodes at half
+// resolution. Decoders without libav's skip-frame and lowres only get the QoS part. The throttle
+// time caps the delivered frame rate and is forwarded upstream so skipped frames are not decoded
+static void ApplyQuality(MediaPipeline* mp)
+{
+    Player* p = mp->player;
+
+    GstElement* sink = gst_bin_get_by_name (GST_BIN (mp->pipeline), "sink");
+    if (sink != NULL)
+    {
+        g_object_set (sink, "qos", p->qualityLevel >= 1, "throttle-time", (guint64)p->throttleTime, NULL);
+        gst_object_unref (sink);
+    }
+
+    GstIterator* it = gst_bin_iterate_recurse (GST_BIN (mp->pipeline));
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next (it, &item) == GST_ITERATOR_OK)
+    {
+        GstElement* element = (GstElement*)g_value_get_object (&item);
+        GstElementFactory* factory = gst_element_get_factory (element);
+        const gchar* klass = factory != NULL ? gst_element_factory_get_metadata (factory, GST_ELEMENT_METADATA_KLASS) : NULL;
+        if (klass != NULL && strstr(klass, "Decoder") != NULL && strstr(klass, "Video") != NULL)
+        {
+            GObjectClass* elementClass = G_OBJECT_GET_CLASS (element);
+            if (g_object_class_find_property (elementClass, "skip-frame") != NULL)
+                g_object_set (element, "skip-frame", p->qualityLevel >= 1 ? 1 : 0, NULL);
+            if (g_object_class_find_property (elementClass, "lowres") != NULL)
+                g_object_set (element, "lowres", p->qualityLevel >= 2 ? 1 : 0, NULL);
+        }
+        g_value_reset (&item);
+    }
+    g_value_unset (&item);
+    gst_iterator_free (it);
+}
+
+// Frames are only delivered once a pipeline is current, so a prerolled standby stays invisible
+static void ConnectSink(MediaPipeline* mp)
+{
+    GstElement* sink = gst_bin_get_by_name (GST_BIN (mp->pipeline), "sink");
+    g_object_set (sink, "emit-signals", TRUE, NULL);
+    g_signal_connect (sink, "new-sample", G_CALLBACK (NewSample), mp);
+    g_signal_connect (sink, "new-preroll", G_CALLBACK (NewPreroll), mp);
+    gst_object_unref(sink);
+
+    if (mp->player->qualityLevel != 0 || mp->player->throttleTime != 0)
+        ApplyQuality(mp);
+}
+
+static uint64_t GetDimensions(MediaPipeline* mp)
+{
+    uint64_t dimensions = 0;
+    GstPad *videopad = NULL;
+    g_signal_emit_by_name (mp->pipeline, "get-video-pad", 0, &videopad);
+    if (videopad == NULL)
+        return dimensions;
+
+    GstCaps *caps;
+    if ((caps = gst_pad_get_current_caps (videopad)))
+    {
         int width = -1, height = -1;
         GstStructure *s = gst_caps_get_structure (caps, 0);
         gst_structure_get_int (s, "width", &width);
@@ -343,163 +1330,681 @@ int main(int argc, char** argv)
         dimensions = (((uint64_t)width) << 32) | height;
     }
     gst_object_unref (videopad);
-    
+    return dimensions;
+}
+
+// Starts prerolling the next queued item while the current one plays
+static void PrerollNext(Player* p)
+{
+    if (p->standby != NULL || p->firstQueued == p->lastQueued || p->suspended)
+        return;
+
+    p->standby = p->current == &p->pipelines[0] ? &p->pipelines[1] : &p->pipelines[0];
+    CreatePipeline(p->standby, (uint32_t)p->queuedItems[p->firstQueued][0], (int64_t)p->queuedItems[p->firstQueued][1], NULL);
+    p->firstQueued = (p->firstQueued + 1) % MaxQueued;
+}
+
+// Promotes the standby pipeline at EOS. The last frame of the previous item stays on screen until
+// the first frame of the next one arrives, so there is no black frame and no new mp process.
+// Returns false while the standby is still prerolling, the caller retries on the next iteration
+static bool SwitchToStandby(Player* p)
+{
+    // Normally prerolled long ago, it is only pending when the previous item was very short
+    GstStateChangeReturn ret = gst_element_get_state (p->standby->pipeline, NULL, NULL, 0);
+    if (ret == GST_STATE_CHANGE_ASYNC)
+        return false;
+
+    if (ret == GST_STATE_CHANGE_FAILURE)
+    {
+        DestroyPipeline(p->standby);
+        p->standby = NULL;
+        PrerollNext(p);
+        return false;
+    }
+
+    // The previous item is done reading before libMediaPlayer hears of the switch, its stream
+    // may be closed right after
+    MediaPipeline* previous = p->current;
+    p->current = p->standby;
+    p->standby = NULL;
+    DestroyPipeline(previous);
+
+    // Announced before the first frame, so libMediaPlayer sees the new visible area with it
+    gint64 duration;
+    gst_element_query_duration(p->current->pipeline, GST_FORMAT_TIME, &duration);
+
     MediaPlayerCommand command;
-    sendto(clientSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&serverSockaddr, sizeof(struct sockaddr_un));
+    command.cmd = MPC_MediaChanged;
+    command.arg[0] = duration;
+    command.arg[1] = GetDimensions(p->current);
+    SendCommand(p, &command);
+    memset(p->visibleRect, 0, sizeof(p->visibleRect));
+
+    ConnectSink(p->current);
+    p->runningTime = 0;
+    PlayAt(p->current, 0);
+
+    StartIndex(p->current);
+    PrerollNext(p);
+    return true;
+}
+
+// Hashes the stream name, size and first bytes and looks them up in the probe cache
+static bool LookupProbe(Player* p)
+{
+    p->probeKey = 0;
+    if (!ProbeCacheEnabled() || p->streamSize < 0)
+        return false;
+
+    uint32_t size = p->streamSize < ProbeHashSize ? (uint32_t)p->streamSize : ProbeHashSize;
+    uint8_t* data = (uint8_t*)malloc(size);
+
+    StreamReader reader;
+    reader.player = p;
+    reader.videoSocket = -1;
+    ConnectStream(&reader, 0);
+    ssize_t read_size = ReadData(&reader, data, size);
+    CloseStream(&reader);
+
+    if (read_size > 0)
+        p->probeKey = ProbeKey(p->streamName, p->streamSize, data, read_size);
+    free(data);
+
+    return p->probeKey != 0 && ProbeLookup(p->probeKey, &p->probe);
+}
+
+static void CopyProbeString(char* dst, size_t size, const gchar* src)
+{
+    // A truncated caps string would not parse, better leave it empty
+    if (src != NULL && strlen(src) < size)
+        strcpy(dst, src);
+}
+
+// Remembers what autoplugging chose for a prerolled pipeline
+static void RecordProbe(MediaPipeline* mp, uint64_t key, uint64_t duration, uint64_t dimensions)
+{
+    ProbeEntry entry;
+    memset(&entry, 0, sizeof(ProbeEntry));
+    entry.key = key;
+    entry.duration = duration;
+    entry.dimensions = dimensions;
+
+    GstIterator* it = gst_bin_iterate_recurse (GST_BIN (mp->pipeline));
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next (it, &item) == GST_ITERATOR_OK)
+    {
+        GstElement* element = (GstElement*)g_value_get_object (&item);
+        GstElementFactory* factory = gst_element_get_factory (element);
+        if (factory != NULL)
+        {
+            const gchar* name = gst_plugin_feature_get_name (factory);
+            if (strcmp(name, "typefind") == 0 && entry.container[0] == 0)
+            {
+                GstCaps* caps = NULL;
+                g_object_get (element, "caps", &caps, NULL);
+                if (caps != NULL)
+                {
+                    gchar* str = gst_caps_to_string (caps);
+                    CopyProbeString(entry.container, sizeof(entry.container), str);
+                    g_free (str);
+                    gst_caps_unref (caps);
+                }
+            }
+            else
+            {
+                const gchar* klass = gst_element_factory_get_metadata (factory, GST_ELEMENT_METADATA_KLASS);
+                char* slot = (char*)ProbeFactory(&entry, klass);
+                if (slot != NULL && slot[0] == 0)
+                    CopyProbeString(slot, sizeof(entry.demuxer), name);
+            }
+        }
+        g_value_reset (&item);
+    }
+    g_value_unset (&item);
+    gst_iterator_free (it);
+
+    GstPad *videopad = NULL;
+    g_signal_emit_by_name (mp->pipeline, "get-video-pad", 0, &videopad);
+    if (videopad != NULL)
+    {
+        GstCaps* caps = gst_pad_get_current_caps (videopad);
+        if (caps != NULL)
+        {
+            gchar* str = gst_caps_to_string (caps);
+            CopyProbeString(entry.caps, sizeof(entry.caps), str);
+            g_free (str);
+            gst_caps_unref (caps);
+        }
+        gst_object_unref (videopad);
+    }
+
+    ProbeStore(&entry);
+}
+
+// Live streams can't come back to a position, so they are never suspended
+static void Suspend(Player* p)
+{
+    MediaPipeline* current = p->current;
+    if (p->suspended || current->live)
+        return;
+
+    if (current->pendingSeek < 0)
+    {
+        gint64 position = 0;
+        gst_element_query_position (current->pipeline, GST_FORMAT_TIME, &position);
+        current->pendingSeek = position;
+    }
+    if (p->resumeState == GST_STATE_VOID_PENDING)
+        p->resumeState = GST_STATE_TARGET (current->pipeline) == GST_STATE_PLAYING ? GST_STATE_PLAYING : GST_STATE_PAUSED;
 
-    if (status != Status_ERROR)
+    ReleaseFrames(p, -1);
+    for (int i = 0; i < 2; i++)
     {
-        gint64 duration;
-        gst_element_query_duration(pipeline, GST_FORMAT_TIME, &duration);
+        MediaPipeline* mp = &p->pipelines[i];
+        if (mp != current && mp != p->standby)
+            continue;
+
+        // A new source starts reading from the beginning again
+        gst_element_set_state (mp->pipeline, GST_STATE_NULL);
+        mp->reader.position = 0;
+        g_atomic_int_set(&mp->status, 0);
+        mp->seekInFlight = false;
+    }
+
+    p->suspended = true;
+    p->resuming = false;
+    memset(p->visibleRect, 0, sizeof(p->visibleRect));
+}
+
+static void Resume(Player* p)
+{
+    MediaPipeline* current = p->current;
+    if (!p->suspended)
+        return;
+
+    // IssueSeek waits for the preroll as if it were a seek in flight
+    p->suspended = false;
+    p->resuming = true;
+    gst_element_set_state (current->pipeline, GST_STATE_PAUSED);
+    current->seekInFlight = true;
+    current->seekTime = MonotonicTime();
+
+    if (p->standby != NULL)
+        gst_element_set_state (p->standby->pipeline, GST_STATE_PAUSED);
+    PrerollNext(p);
+}
+
+// Prerolls the first item and serves commands until MPC_Quit. In process mode this is the whole
+// life of mp, in-process it runs on the player thread with its own main context
+static void RunPlayer(Player* p)
+{
+    if (p->context != NULL)
+        g_main_context_push_thread_default(p->context);
+
+    bool cached = LookupProbe(p);
+    CreatePipeline(p->current, 0, p->streamSize, cached ? &p->probe : NULL);
+
+    MediaPlayerCommand command;
+    memset(&command, 0, sizeof(MediaPlayerCommand));
+    if (cached)
+    {
+        // Known media is reported loaded straight from the cache while it prerolls
+        SendCommand(p, &command);
 
-        //MediaPlayerCommand command;
         command.cmd = MPC_MediaLoaded;
+        command.arg[0] = p->probe.duration;
+        command.arg[1] = p->probe.dimensions;
+        SendCommand(p, &command);
+    }
+
+    // Wait for the pipeline to preroll
+    GstStateChangeReturn ret = gst_element_get_state (p->current->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+    if (cached && ret == GST_STATE_CHANGE_FAILURE)
+    {
+        // The cached choices no longer work here, forget them and autoplug from scratch
+        ProbeRemove(p->probeKey);
+        DestroyPipeline(p->current);
+        CreatePipeline(p->current, 0, p->streamSize, NULL);
+        ret = gst_element_get_state (p->current->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+    }
+
+    if (p->current->live && ret == GST_STATE_CHANGE_NO_PREROLL)
+    {
+        // Live sources don't preroll, they run until the first decoded frame tells the dimensions.
+        // The appsink only keeps the newest frame meanwhile
+        gst_element_set_state (p->current->pipeline, GST_STATE_PLAYING);
+        uint64_t start = MonotonicTime();
+        while (GetDimensions(p->current) == 0 && (g_atomic_int_get(&p->current->status) & Status_ERROR) == 0 &&
+            MonotonicTime() - start < LiveStartTimeout)
+        {
+            while (g_main_context_pending(p->context))
+                g_main_context_iteration(p->context, FALSE);
+            g_usleep(10000);
+        }
+
+        if (GetDimensions(p->current) == 0)
+            g_atomic_int_or(&p->current->status, Status_ERROR);
+    }
+
+    ConnectSink(p->current);
+    uint64_t dimensions = GetDimensions(p->current);
+    gint64 duration = 0;
+    if (!gst_element_query_duration(p->current->pipeline, GST_FORMAT_TIME, &duration))
+        duration = -1;
+
+    if (!cached)
+    {
+        // Lets libMediaPlayer know where to send commands
+        SendCommand(p, &command);
+
+        if ((g_atomic_int_get(&p->current->status) & Status_ERROR) == 0)
+        {
+            //MediaPlayerCommand command;
+            command.cmd = MPC_MediaLoaded;
+            command.arg[0] = duration;
+            command.arg[1] = dimensions;
+
+            SendCommand(p, &command);
+        }
+    }
+    else if ((uint64_t)duration != p->probe.duration || dimensions != p->probe.dimensions)
+    {
+        command.cmd = MPC_MediaChanged;
         command.arg[0] = duration;
         command.arg[1] = dimensions;
+        SendCommand(p, &command);
+    }
 
-        sendto(clientSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&serverSockaddr, sizeof(struct sockaddr_un));
+    if (ret != GST_STATE_CHANGE_FAILURE)
+    {
+        if (p->probeKey != 0 && (p->current->probe == NULL || (uint64_t)duration != p->probe.duration ||
+            dimensions != p->probe.dimensions))
+        {
+            RecordProbe(p->current, p->probeKey, duration, dimensions);
+        }
+
+        if (!p->current->live)
+            StartIndex(p->current);
     }
-    
-    int flags = fcntl(clientSocket, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(clientSocket, F_SETFL, flags);
 
-    while(true)
+    SetBlocking(p, false);
+
+    while(!p->quit)
     {
         MediaPlayerCommand command;
-        if (status != 0)
+        MediaPipeline* current = p->current;
+        if (p->standby != NULL && (g_atomic_int_get(&p->standby->status) & Status_ERROR) != 0)
+        {
+            // Skip items that fail to preroll
+            DestroyPipeline(p->standby);
+            p->standby = NULL;
+            PrerollNext(p);
+        }
+
+        // Every pending event is seen, an error is reported even when EOS arrived behind it
+        guint status = g_atomic_int_get(&current->status);
+        if ((status & Status_SEGMENT_DONE) != 0 && (status & Status_ERROR) == 0)
         {
-            if (status == Status_EOS)
+            g_atomic_int_and(&current->status, ~Status_SEGMENT_DONE);
+            if (p->looping)
             {
-                int flags = fcntl(clientSocket, F_GETFL, 0);
-                flags &= ~O_NONBLOCK;
-                fcntl(clientSocket, F_SETFL, flags);
-                
-                command.cmd = MPC_MediaEnded;
-                command.arg[0] = 0;
-                command.arg[1] = 0;
-                close(videoSocket);
-                videoSocket = socket(AF_UNIX, SOCK_STREAM, 0);
-                connect(videoSocket, (sockaddr*)&videoServerSockaddr, sizeof(sockaddr_un));
-                sendto(clientSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&serverSockaddr, sizeof(struct sockaddr_un));
+                Loop(current->pipeline);
+                continue;
             }
-            else if (status == Status_ERROR)
+
+            // Looping was turned off during the last segment
+            status |= Status_EOS;
+        }
+
+        if ((status & (Status_EOS | Status_ERROR)) == Status_EOS && p->standby != NULL)
+        {
+            // EOS stays pending until the standby has prerolled, commands keep flowing meanwhile.
+            // The previous pipeline is reset by CreatePipeline before its slot is reused
+            if (SwitchToStandby(p))
+                current = p->current;
+        }
+        else if ((status & (Status_EOS | Status_ERROR)) != 0)
+        {
+            g_atomic_int_and(&current->status, ~(Status_EOS | Status_ERROR | Status_SEGMENT_DONE));
+            if ((status & Status_ERROR) != 0)
             {
-                int flags = fcntl(clientSocket, F_GETFL, 0);
-                flags &= ~O_NONBLOCK;
-                fcntl(clientSocket, F_SETFL, flags);
-                
+                SetBlocking(p, true);
+
                 command.cmd = MPC_MediaFailed;
                 command.arg[0] = 0;
                 command.arg[1] = 0;
 
-                sendto(clientSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&serverSockaddr, sizeof(struct sockaddr_un));
+                SendCommand(p, &command);
             }
-            else if (status == Status_READY)
+            else
             {
+                SetBlocking(p, true);
+
+                command.cmd = MPC_MediaEnded;
+                command.arg[0] = 0;
+                command.arg[1] = 0;
+                ConnectStream(&current->reader, current->reader.streamIndex);
+                SendCommand(p, &command);
             }
-            
-            status = 0;
         }
 
-        sockaddr_un clientSockaddr;
-        socklen_t socklen = sizeof(sockaddr_un);
-        pollfd fds;
-        fds.fd = clientSocket;
-        fds.events = POLLIN;
-        if (poll(&fds, 1, 10) != -1)
+        // Don't wait forever for an ASYNC_DONE that an error swallowed
+        if (current->seekInFlight && MonotonicTime() - current->seekTime > SeekTimeout)
+        {
+            current->seekInFlight = false;
+        }
+
+        // Drain every pending command without blocking, state changes complete asynchronously
+        int timeout = 10;
+        int fd;
+        while (ReceiveCommand(p, &command, &fd, timeout))
         {
-            if (recvfrom(clientSocket, &command, sizeof(MediaPlayerCommand), 0, (sockaddr*)&serverSockaddr, &socklen) != -1)
+            timeout = 0;
+            if (command.cmd == MPC_Play)
             {
-                if (command.cmd == MPC_Play)
+                SetBlocking(p, false);
+
+                if (p->resumeState != GST_STATE_VOID_PENDING)
+                    p->resumeState = GST_STATE_PLAYING;
+                else if (p->syncClock && (current->seekInFlight || current->pendingSeek >= 0))
                 {
-                    int flags = fcntl(clientSocket, F_GETFL, 0);
-                    flags |= O_NONBLOCK;
-                    fcntl(clientSocket, F_SETFL, flags);
+                    p->startPending = true;
+                    p->startTime = command.arg[0];
+                }
+                else
+                    PlayAt(current, command.arg[0]);
+            }
+            else if (command.cmd == MPC_Pause)
+            {
+                SetBlocking(p, true);
+
+                if (p->resumeState != GST_STATE_VOID_PENDING)
+                    p->resumeState = GST_STATE_PAUSED;
+                else
+                    PauseAt(current, command.arg[0]);
+            }
+            else if (command.cmd == MPC_Stop)
+            {
+                ReleaseFrames(p, -1);
+                SetBlocking(p, true);
 
-                    gst_element_set_state (pipeline, GST_STATE_PLAYING);
-                    gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+                if (p->resumeState != GST_STATE_VOID_PENDING)
+                    p->resumeState = GST_STATE_PAUSED;
+                else
+                    PauseAt(current, 0);
+                if (!current->live)
+                    current->pendingSeek = 0;
+            }
+            else if (command.cmd == MPC_Seek)
+            {
+                if (((int64_t)command.arg[0]) >= 0 && !current->live)
+                {
+                    ReleaseFrames(p, -1);
+                    current->pendingSeek = command.arg[0];
+                    p->seekStartTime = command.arg[1];
+                    if (p->startPending)
+                        p->startTime = command.arg[1];
                 }
-                else if (command.cmd == MPC_Pause)
+            }
+            else if (command.cmd == MPC_Volume)
+            {
+                union FU64
                 {
-                    int flags = fcntl(clientSocket, F_GETFL, 0);
-                    flags &= ~O_NONBLOCK;
-                    fcntl(clientSocket, F_SETFL, flags);
+                    float f;
+                    uint64_t u;
+                } cast;
+                cast.u = command.arg[0];
 
-                    gst_element_set_state (pipeline, GST_STATE_PAUSED);
-                }
-                else if (command.cmd == MPC_Stop)
+                p->volume = cast.f;
+                g_object_set (current->pipeline, "volume", p->volume, NULL);
+                if (p->standby != NULL)
+                    g_object_set (p->standby->pipeline, "volume", p->volume, NULL);
+            }
+            else if (command.cmd == MPC_Loop)
+            {
+                bool enable = command.arg[0] != 0 && !current->live;
+                if (enable && !p->looping)
                 {
-                    for (; firstFrame != lastFrame; firstFrame = (firstFrame + 1) % MaxFrames)
-                    {
-                        close(storedFrames[firstFrame].fd);
-                        gst_buffer_unmap (storedFrames[firstFrame].buffer, &storedFrames[firstFrame].map);
-                        gst_sample_unref (storedFrames[firstFrame].sample);
-                    }
-                    int flags = fcntl(clientSocket, F_GETFL, 0);
-                    flags &= ~O_NONBLOCK;
-                    fcntl(clientSocket, F_SETFL, flags);
-
-                    gst_element_set_state (pipeline, GST_STATE_PAUSED);
-                    // Wait for the pipeline to preroll
-                    gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-
-                    gst_element_seek_simple (pipeline, GST_FORMAT_TIME, (GstSeekFlags)(GST_SEEK_FLAG_ACCURATE | GST_SEEK_FLAG_FLUSH), 0);
-
-                    gst_element_set_state (pipeline, GST_STATE_PAUSED);
-
-                    // Wait for the pipeline to preroll
-                    gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+                    // Enter segment mode once, from then on wrapping never flushes
+                    p->looping = true;
+                    gint64 position = 0;
+                    gst_element_query_position (current->pipeline, GST_FORMAT_TIME, &position);
+                    if (current->pendingSeek < 0)
+                        current->pendingSeek = position;
                 }
-                else if (command.cmd == MPC_Seek)
+
+                p->looping = enable;
+            }
+            else if (command.cmd == MPC_Quality)
+            {
+                p->qualityLevel = (uint32_t)command.arg[0];
+                p->throttleTime = command.arg[1];
+                ApplyQuality(current);
+            }
+            else if (command.cmd == MPC_Latency)
+            {
+                p->latencyTarget = command.arg[0];
+                if (current->live)
+                    gst_pipeline_set_latency (GST_PIPELINE (current->pipeline), p->latencyTarget != 0 ? p->latencyTarget : GST_CLOCK_TIME_NONE);
+            }
+            else if (command.cmd == MPC_Queue)
+            {
+                // libMediaPlayer stops queueing before its stream slots run out, a full ring would
+                // otherwise look empty
+                if ((p->lastQueued + 1) % MaxQueued == p->firstQueued)
                 {
-                    if (((int64_t)command.arg[0]) >= 0)
-                    {
-                        for (; firstFrame != lastFrame; firstFrame = (firstFrame + 1) % MaxFrames)
-                        {
-                            close(storedFrames[firstFrame].fd);
-                            gst_buffer_unmap (storedFrames[firstFrame].buffer, &storedFrames[firstFrame].map);
-                            gst_sample_unref (storedFrames[firstFrame].sample);
-                        }
-                        gst_element_seek_simple (pipeline, GST_FORMAT_TIME, (GstSeekFlags)(GST_SEEK_FLAG_ACCURATE | GST_SEEK_FLAG_FLUSH), command.arg[0]);
-                        gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-                    }
+                    printf ("WARNING queue full, item %u dropped\n", (uint)command.arg[0]);
                 }
-                else if (command.cmd == MPC_Volume)
+                else
                 {
-                    union FU64
-                    {
-                        float f;
-                        uint64_t u;
-                    } cast;
-                    cast.u = command.arg[0];
-                    
-                    g_object_set (pipeline, "volume", (double)cast.f, NULL);
+                    p->queuedItems[p->lastQueued][0] = command.arg[0];
+                    p->queuedItems[p->lastQueued][1] = command.arg[1];
+                    p->lastQueued = (p->lastQueued + 1) % MaxQueued;
+                    PrerollNext(p);
                 }
-                else if (command.cmd == MPC_FrameAck)
+            }
+            else if (command.cmd == MPC_SyncClock)
+            {
+                bool enable = command.arg[0] != 0;
+                if (enable != p->syncClock)
                 {
-                    gint64 lastFrameAck = command.arg[0];
-                    for (; firstFrame != lastFrame; firstFrame = (firstFrame + 1) % MaxFrames)
-                    {
-                        if (storedFrames[firstFrame].time == lastFrameAck)
-                            break;
-                        close(storedFrames[firstFrame].fd);
-                        gst_buffer_unmap (storedFrames[firstFrame].buffer, &storedFrames[firstFrame].map);
-                        gst_sample_unref (storedFrames[firstFrame].sample);
-                    }
+                    // The clock is only picked going to PLAYING, so a playing pipeline restarts
+                    bool playing = GST_STATE_TARGET (current->pipeline) == GST_STATE_PLAYING;
+                    if (playing)
+                        PauseAt(current, 0);
+
+                    p->syncClock = enable;
+                    p->startPending = false;
+                    UseSharedClock(current, enable);
+                    if (p->standby != NULL)
+                        UseSharedClock(p->standby, enable);
+
+                    if (playing)
+                        PlayAt(current, 0);
                 }
             }
+            else if (command.cmd == MPC_Suspend)
+            {
+                Suspend(p);
+            }
+            else if (command.cmd == MPC_Resume)
+            {
+                Resume(p);
+            }
+            else if (command.cmd == MPC_FrameAck)
+            {
+                gint64 lastFrameAck = command.arg[0];
+                TraceInstant("MPC_FrameAck received", p->traceId, "pts", lastFrameAck);
+                AckFrames(p, lastFrameAck, fd);
+                fd = -1;
+            }
+            else if (command.cmd == MPC_Quit)
+            {
+                p->quit = true;
+            }
+
+            if (fd != -1)
+                close(fd);
+        }
+
+        // Fences of acked frames signal on their own, without a command to wake us up
+        ReleaseAckedFrames(p);
+
+        if (p->resuming && !current->seekInFlight)
+        {
+            // Prerolled at the start, frames are shown again from the seek on
+            p->resuming = false;
+        }
+
+        if (!p->suspended)
+            IssueSeek(current);
+
+        if (p->resumeState != GST_STATE_VOID_PENDING && !p->suspended && !p->resuming &&
+            !current->seekInFlight && current->pendingSeek < 0)
+        {
+            // The decoders are new, so the quality settings are applied again
+            ApplyQuality(current);
+            if (p->resumeState == GST_STATE_PLAYING)
+                PlayAt(current, 0);
+            else
+                gst_element_set_state (current->pipeline, p->resumeState);
+            p->resumeState = GST_STATE_VOID_PENDING;
+        }
+
+        if (p->startPending && !p->suspended && !p->resuming && !current->seekInFlight &&
+            current->pendingSeek < 0)
+        {
+            // Started at a clock time already past, the first frames are late and catch up
+            p->startPending = false;
+            PlayAt(current, p->startTime);
         }
-        
-        if (g_main_context_pending(nullptr))
+
+        SendKeyframes(p, &current->index);
+
+        while (g_main_context_pending(p->context))
         {
-            g_main_context_iteration(nullptr, FALSE);
+            g_main_context_iteration(p->context, FALSE);
         }
     }
+
+    ReleaseFrames(p, -1);
+    if (p->standby != NULL)
+        DestroyPipeline(p->standby);
+    DestroyPipeline(p->current);
+
+    if (p->context != NULL)
+        g_main_context_pop_thread_default(p->context);
+}
+
+#ifdef MP_IN_PROCESS
+
+static void* PlayerThreadFunc(void* data)
+{
+    Player* player = (Player*)data;
+    ApplyScheduling(&player->scheduling);
+    RunPlayer(player);
+    return nullptr;
+}
+
+void* StartEmbeddedPlayer(EmbeddedChannel* channel, int64_t streamSize, const char* streamName)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, []() { gst_init(NULL, NULL); TraceOpen(false); });
+
+    Player* player = new Player;
+    InitPlayer(player);
+    player->channel = channel;
+    player->traceId = channel->traceId;
+    player->scheduling = channel->scheduling;
+    player->streamSize = streamSize;
+    strncpy(player->streamName, streamName, sizeof(player->streamName) - 1);
+    player->context = g_main_context_new();
+
+    if (pthread_create(&player->thread, nullptr, PlayerThreadFunc, player) != 0)
+    {
+        g_main_context_unref(player->context);
+        delete player;
+        return nullptr;
+    }
+
+    return player;
+}
+
+void StopEmbeddedPlayer(void* data)
+{
+    Player* player = (Player*)data;
+
+    MediaPlayerCommand command;
+    memset(&command, 0, sizeof(MediaPlayerCommand));
+    command.cmd = MPC_Quit;
+    PushCommand(&player->channel->toPlayer, &command, -1);
+
+    pthread_join(player->thread, nullptr);
+    g_main_context_unref(player->context);
+    delete player;
+}
+
+#else
+
+void SignalHandler(int)
+{
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        exit(-1);
+    }
+
+    signal(SIGTERM, &SignalHandler);
+    TraceOpen(false);
+
+    const char* tmpDir = argv[1];
+    const char* streamSizeStr = argv[2];
+
+    static Player player;
+    InitPlayer(&player);
+    player.streamSize = atoll(streamSizeStr);
+    if (argc == 4)
+        strncpy(player.streamName, argv[3], sizeof(player.streamName) - 1);
+
+    player.clientSocket = socket(AF_UNIX, SOCK_DGRAM, 0);
     
-    g_source_remove(bus_watch_id);
-    gst_object_unref(GST_OBJECT(pipeline));
+    char clientSocketPath[256];
+    strcpy(clientSocketPath, tmpDir);
+    strcat(clientSocketPath, "/client_socket");
+
+    sockaddr_un clientSockaddr;
+    memset(&clientSockaddr, 0, sizeof(sockaddr_un));
+    clientSockaddr.sun_family = AF_UNIX;        
+    strcpy(clientSockaddr.sun_path, clientSocketPath);
+    unlink(clientSocketPath);
+    bind(player.clientSocket, (sockaddr*)&clientSockaddr, sizeof(sockaddr_un));
     
-    close(clientSocket);
+    char serverSocketPath[256];
+    strcpy(serverSocketPath, tmpDir);
+    strcat(serverSocketPath, "/server_socket");
+
+    memset(&player.serverSockaddr, 0, sizeof(sockaddr_un));
+    player.serverSockaddr.sun_family = AF_UNIX;        
+    strcpy(player.serverSockaddr.sun_path, serverSocketPath);
+    
+    char videoServerSocketPath[256];
+    strcpy(videoServerSocketPath, tmpDir);
+    strcat(videoServerSocketPath, "/video_socket");
+    
+    memset(&player.videoServerSockaddr, 0, sizeof(sockaddr_un));
+    player.videoServerSockaddr.sun_family = AF_UNIX;        
+    strcpy(player.videoServerSockaddr.sun_path, videoServerSocketPath);
+    
+    gst_init(NULL, NULL);
+
+    RunPlayer(&player);
+    
+    close(player.clientSocket);
     return 0;
 }
+
+#endif
@@ -1,6 +1,7 @@
 using Noesis;
 using NoesisApp;
 using System;
+using System.Collections.Generic;
 using System.IO;
 using System.Runtime.InteropServices;
 
@@ -11,20 +12,22 @@ namespace NoesisApp
         static GEMediaPlayer()
         {
             InitMediaPlayer();
+            AppDomain.CurrentDomain.ProcessExit += (sender, e) => ShutdownMediaPlayer();
         }
 
         GEMediaPlayer(MediaElement owner, Uri uri)
         {
+            string sharingKey = SharingKey != null ? SharingKey(uri) :
+                (ShareIdenticalSources ? uri.OriginalString : null);
             _stream = Noesis.GUI.LoadXamlResource(uri.OriginalString);
+
             if (_stream != null)
             {
                 _state = CreateState();
-            
-                _streamHandle = GCHandle.Alloc(_stream);
-                StreamReadDelegate readFn = new StreamReadDelegate(StreamRead);
-                _readFnHandle = GCHandle.Alloc(readFn);
-                StreamSeekDelegate seekFn = new StreamSeekDelegate(StreamSeek);
-                _seekFnHandle = GCHandle.Alloc(seekFn);
+                if (VideoCpuAffinity.HasValue) SetCpuAffinity(_state, VideoCpuAffinity.Value);
+                if (VideoSchedulingPolicy.HasValue) SetSchedulingPolicy(_state, VideoSchedulingPolicy.Value);
+                if (VideoSchedulingPriority.HasValue) SetSchedulingPriority(_state, VideoSchedulingPriority.Value);
+                if (EventPump.HasValue) SetEventPump(_state, EventPump.Value);
 
                 MediaOpenedDelegate mediaOpenedFn = new MediaOpenedDelegate(this.OnMediaOpened);
                 _mediaOpenedFnHandle = GCHandle.Alloc(mediaOpenedFn);
@@ -33,10 +36,169 @@ namespace NoesisApp
                 MediaFailedDelegate mediaFailedFn = new MediaFailedDelegate(this.OnMediaFailed);
                 _mediaFailedFnHandle = GCHandle.Alloc(mediaFailedFn);
 
-                long streamSize = _stream.Length;
-                OpenMedia(_state, GCHandle.ToIntPtr(_streamHandle), uri.GetPath(), streamSize, readFn, seekFn, mediaOpenedFn, mediaEndedFn, mediaFailedFn);
+                // Streams that can't seek are played live, as they arrive
+                long streamSize = _stream.CanSeek ? _stream.Length : -1;
+                if (sharingKey != null)
+                {
+                    _sharedStream = OpenSharedStream(sharingKey, uri, streamSize, mediaOpenedFn, mediaEndedFn,
+                        mediaFailedFn);
+                }
+                else
+                {
+                    _streamHandle = GCHandle.Alloc(_stream);
+                    StreamReadDelegate readFn = new StreamReadDelegate(StreamRead);
+                    _readFnHandle = GCHandle.Alloc(readFn);
+                    StreamSeekDelegate seekFn = new StreamSeekDelegate(StreamSeek);
+                    _seekFnHandle = GCHandle.Alloc(seekFn);
+
+                    OpenMedia(_state, GCHandle.ToIntPtr(_streamHandle), uri.GetPath(), streamSize, readFn, seekFn, mediaOpenedFn, mediaEndedFn, mediaFailedFn);
+                }
             }
             owner.View.Rendering += OnRendering;
+            owner.IsVisibleChanged += OnIsVisibleChanged;
+        }
+
+        /// <summary>
+        /// Mask of the cores decoding and stream reading may run on, used by players created
+        /// afterwards. Keep the core the UI renders on out of it. Null uses MP_VIDEO_CPUS
+        /// </summary>
+        public static ulong? VideoCpuAffinity { get; set; }
+
+        /// <summary>
+        /// Linux SCHED_* policy of the video threads of players created afterwards, -1 to inherit.
+        /// Null uses MP_VIDEO_POLICY
+        /// </summary>
+        public static int? VideoSchedulingPolicy { get; set; }
+
+        /// <summary>
+        /// Nice value of the video threads, or their priority for SCHED_FIFO and SCHED_RR. Null uses
+        /// MP_VIDEO_PRIORITY
+        /// </summary>
+        public static int? VideoSchedulingPriority { get; set; }
+
+        /// <summary>
+        /// Whether players created afterwards receive frames and events on a thread of their own,
+        /// as soon as they arrive, instead of only when the UI renders. Events are still raised
+        /// on the UI thread. Null uses MP_EVENT_PUMP
+        /// </summary>
+        public static bool? EventPump { get; set; }
+
+        /// <summary>
+        /// Blocks until a player with an event pump received a frame or an event, or the timeout
+        /// expires. Returns false on timeout, when no video needs the UI to render again
+        /// </summary>
+        public static bool WaitForEvents(uint timeoutMs)
+        {
+            return NativeWaitForEvents(timeoutMs);
+        }
+
+        /// <summary>
+        /// Gets or sets a value that indicates whether players created afterwards for the same uri
+        /// share one decoder. Each frame is decoded once and drawn by every player, and playback
+        /// commands of any of them drive all of them
+        /// </summary>
+        public static bool ShareIdenticalSources { get; set; }
+
+        /// <summary>
+        /// Gets or sets the function giving the sharing key of a uri. Players created with the same
+        /// key share one decoder, null shares nothing. Takes precedence over ShareIdenticalSources
+        /// </summary>
+        public static Func<Uri, string> SharingKey { get; set; }
+
+        /// <summary>
+        /// Gets or sets, in bytes, the video memory all players may use together. When over it,
+        /// players that have not been drawn for a while release their decoder until drawn again.
+        /// With a budget set, hidden players that are muted or at zero volume release it right
+        /// away. 0 means no budget. Defaults to MP_VIDEO_MEMORY_BUDGET, in megabytes
+        /// </summary>
+        public static ulong VideoMemoryBudget
+        {
+            get { return GetVideoMemoryBudget(); }
+            set { SetVideoMemoryBudget(value); }
+        }
+
+        /// <summary>
+        /// Gets or sets, in seconds, how long a looping clip may be to be decoded once and then
+        /// played from textures. 0 disables it. Defaults to MP_FRAME_CACHE_DURATION
+        /// </summary>
+        public static double FrameCacheDuration
+        {
+            get { return GetFrameCacheDuration(); }
+            set { SetFrameCacheDuration(value); }
+        }
+
+        /// <summary>
+        /// Gets or sets, in bytes, the texture memory one cached clip may take. Defaults to
+        /// MP_FRAME_CACHE_SIZE, in megabytes
+        /// </summary>
+        public static ulong FrameCacheSize
+        {
+            get { return GetFrameCacheSize(); }
+            set { SetFrameCacheSize(value); }
+        }
+
+        /// <summary>
+        /// Gets or sets whether decoded frames are imported on a worker thread as they arrive, so
+        /// rendering only binds a ready texture. Needs EGL_KHR_wait_sync. The worker starts on the
+        /// next render and stays until the process exits. Defaults to MP_IMPORT_THREAD
+        /// </summary>
+        public static bool ImportThread
+        {
+            get { return GetImportThread(); }
+            set { SetImportThread(value); }
+        }
+
+        /// <summary>
+        /// Gets or sets whether the stream reads of all players are served by one scheduler, most
+        /// urgent first and in large sequential blocks. Applies to players opened afterwards.
+        /// Defaults to MP_IO_SCHEDULER
+        /// </summary>
+        public static bool IoScheduler
+        {
+            get { return GetIoScheduler(); }
+            set { SetIoScheduler(value); }
+        }
+
+        /// <summary>
+        /// Gets or sets, in bytes, how much the scheduler reads from a stream at once. Defaults to
+        /// MP_IO_BLOCK_SIZE, in kilobytes
+        /// </summary>
+        public static uint IoBlockSize
+        {
+            get { return GetIoBlockSize(); }
+            set { SetIoBlockSize(value); }
+        }
+
+        /// <summary>
+        /// Gets the estimated video memory, in bytes, used by all players
+        /// </summary>
+        public static ulong VideoMemoryUsage
+        {
+            get { return GetVideoMemoryUsage(); }
+        }
+
+        /// <summary>
+        /// Starts every player of the group at the same time, frame-synchronized
+        /// </summary>
+        public static void GroupPlay(uint group)
+        {
+            NativeGroupPlay(group);
+        }
+
+        /// <summary>
+        /// Pauses every player of the group at the same time
+        /// </summary>
+        public static void GroupPause(uint group)
+        {
+            NativeGroupPause(group);
+        }
+
+        /// <summary>
+        /// Seeks every player of the group. Playing players restart together once all prerolled
+        /// </summary>
+        public static void GroupSeek(uint group, double position)
+        {
+            NativeGroupSeek(group, position);
         }
 
         ~GEMediaPlayer()
@@ -50,15 +212,30 @@ namespace NoesisApp
             {
                 DestroyState(_state);
 
-                _streamHandle.Free();
-                _readFnHandle.Free();
-                _seekFnHandle.Free();
+                if (_sharedStream != null)
+                {
+                    ReleaseSharedStream(_sharedStream);
+                    _sharedStream = null;
+                }
+                else
+                {
+                    _streamHandle.Free();
+                    _readFnHandle.Free();
+                    _seekFnHandle.Free();
+                    _stream.Close();
+                }
 
                 _mediaOpenedFnHandle.Free();
                 _mediaEndedFnHandle.Free();
                 _mediaFailedFnHandle.Free();
 
-                _stream.Close();
+                foreach (GCHandle handle in _queuedHandles)
+                {
+                    ((Stream)handle.Target).Close();
+                    handle.Free();
+                }
+                _queuedHandles.Clear();
+
                 _stream = null;
             }
         }
@@ -93,6 +270,25 @@ namespace NoesisApp
             get { return (_stream != null) ? GetBufferingProgress(_state) : 0; }
         }
 
+        /// <summary>
+        /// Gets a value that indicates whether the media is a live stream. Live streams are opened
+        /// from streams that can't seek, have no duration and ignore Seek and IsLooping
+        /// </summary>
+        public bool IsLive
+        {
+            get { return (_stream != null) ? GetIsLive(_state) : false; }
+        }
+
+        /// <summary>
+        /// Gets or sets, in seconds, how far behind capture the frames of a live stream are shown.
+        /// 0 uses the lowest latency the stream allows
+        /// </summary>
+        public double LatencyTarget
+        {
+            get { return (_stream != null) ? GetLatencyTarget(_state) : 0.0; }
+            set { if (_stream != null) SetLatencyTarget(_state, value); }
+        }
+
         public override float DownloadProgress
         {
             get { return (_stream != null) ? GetDownloadProgress(_state) : 0; }
@@ -139,6 +335,80 @@ namespace NoesisApp
             set { if (_stream != null) SetScrubbingEnabled(_state, value); }
         }
 
+        /// <summary>
+        /// Gets or sets a value that indicates whether the media restarts seamlessly when it reaches
+        /// the end. MediaEnded is not raised while looping
+        /// </summary>
+        public bool IsLooping
+        {
+            get { return (_stream != null) ? GetIsLooping(_state) : false; }
+            set { if (_stream != null) SetIsLooping(_state, value); }
+        }
+
+        /// <summary>
+        /// Gets or sets a value that indicates whether decoding quality is lowered automatically
+        /// when frames are dropped or rendered late, and raised back once rendering keeps up
+        /// </summary>
+        public bool AdaptiveQuality
+        {
+            get { return (_stream != null) ? GetAdaptiveQuality(_state) : false; }
+            set { if (_stream != null) SetAdaptiveQuality(_state, value); }
+        }
+
+        /// <summary>
+        /// Gets or sets the maximum number of frames per second delivered. 0 means no limit
+        /// </summary>
+        public float MaxFrameRate
+        {
+            get { return (_stream != null) ? GetMaxFrameRate(_state) : 0.0f; }
+            set { if (_stream != null) SetMaxFrameRate(_state, value); }
+        }
+
+        /// <summary>
+        /// Gets or sets the synchronization group, 0 for none. Players of a group share one clock,
+        /// so they don't drift apart, and are driven together with GroupPlay, GroupPause and
+        /// GroupSeek
+        /// </summary>
+        public uint SyncGroup
+        {
+            get { return (_stream != null) ? GetSyncGroup(_state) : 0; }
+            set { if (_stream != null) SetSyncGroup(_state, value); }
+        }
+
+        /// <summary>
+        /// Gets a value that indicates whether the player released its decoder because it was
+        /// hidden or over the video memory budget. It resumes from the same position when drawn
+        /// </summary>
+        public bool IsSuspended
+        {
+            get { return (_stream != null) ? GetIsSuspended(_state) : false; }
+        }
+
+        /// <summary>
+        /// Gets a value that indicates whether the clip plays from its frame cache, with the
+        /// decoder suspended
+        /// </summary>
+        public bool IsFrameCached
+        {
+            get { return (_stream != null) ? GetIsFrameCached(_state) : false; }
+        }
+
+        /// <summary>
+        /// Gets the bytes per second the I/O scheduler read lately for this player
+        /// </summary>
+        public double ReadRate
+        {
+            get { return (_stream != null) ? GetReadRate(_state) : 0.0; }
+        }
+
+        /// <summary>
+        /// Gets the current degradation level, from 0 (full quality) to 3
+        /// </summary>
+        public uint QualityLevel
+        {
+            get { return (_stream != null) ? GetQualityLevel(_state) : 0; }
+        }
+
         public override void Play()
         {
             if (_stream != null) Play(_state);
@@ -154,6 +424,128 @@ namespace NoesisApp
             if (_stream != null) Stop(_state);
         }
 
+        /// <summary>
+        /// Queues media to play right after the current one ends. The next item is prerolled while
+        /// the current one plays, so they are played back without a gap. Ignored by players
+        /// sharing a decoder. Returns false when the item was not queued, for example when the
+        /// queue is full
+        /// </summary>
+        public bool QueueMedia(Uri uri)
+        {
+            if (_stream != null && _sharedStream == null)
+            {
+                Stream stream = Noesis.GUI.LoadXamlResource(uri.OriginalString);
+                if (stream != null)
+                {
+                    GCHandle handle = GCHandle.Alloc(stream);
+                    if (QueueMedia(_state, GCHandle.ToIntPtr(handle), stream.CanSeek ? stream.Length : -1))
+                    {
+                        _queuedHandles.Add(handle);
+                        return true;
+                    }
+
+                    handle.Free();
+                    stream.Close();
+                }
+            }
+
+            return false;
+        }
+
+        /// <summary>
+        /// Shows only a region of the video, in pixels. Width and Height become the size of the
+        /// region. Meant for atlas videos that pack several animations in one stream. An empty
+        /// rectangle shows the whole video again
+        /// </summary>
+        public void SetCropRect(uint x, uint y, uint width, uint height)
+        {
+            if (_stream != null)
+            {
+                SetCropRect(_state, x, y, width, height);
+                UpdateTextureSize();
+            }
+        }
+
+        public enum ReadbackFormat
+        {
+            Rgba,
+            Rgb565
+        }
+
+        /// <summary>
+        /// Asks for the next frame drawn as CPU pixels, scaled to width x height or to the size
+        /// shown when 0. Rgb565 falls back to Rgba where the GPU can't read it back. The pixels are
+        /// available from TryGetReadback a frame or two later, the render thread never waits.
+        /// OpenGL ES 2.0 contexts read synchronously, and the pixels are available right after
+        /// the frame is drawn
+        /// </summary>
+        public void RequestReadback(uint width, uint height, ReadbackFormat format)
+        {
+            if (_stream != null) RequestReadback(_state, width, height, (uint)format);
+        }
+
+        /// <summary>
+        /// Takes the last completed readback, top row first and tightly packed. Time is the
+        /// position of the frame in seconds
+        /// </summary>
+        public bool TryGetReadback(out byte[] pixels, out uint width, out uint height,
+            out ReadbackFormat format, out double time)
+        {
+            pixels = null;
+            width = 0;
+            height = 0;
+            format = ReadbackFormat.Rgba;
+            time = 0.0;
+
+            if (_stream == null)
+                return false;
+
+            uint nativeFormat;
+            GetReadback(_state, null, 0, out width, out height, out nativeFormat, out time);
+            if (width == 0 || height == 0)
+                return false;
+
+            uint bytesPerPixel = nativeFormat == (uint)ReadbackFormat.Rgb565 ? 2u : 4u;
+            byte[] buffer = new byte[width * height * bytesPerPixel];
+            if (!GetReadback(_state, buffer, (uint)buffer.Length, out width, out height, out nativeFormat, out time))
+                return false;
+
+            pixels = buffer;
+            format = (ReadbackFormat)nativeFormat;
+            return true;
+        }
+
+        /// <summary>
+        /// Gets the times, in seconds, of the keyframes indexed so far. Seeking to one of them needs
+        /// no decode-forward, so they are good snapping points for seek bars
+        /// </summary>
+        public double[] GetKeyframes()
+        {
+            if (_stream == null)
+                return new double[0];
+
+            uint count = GetKeyframes(_state, null, 0);
+            double[] times = new double[count];
+            GetKeyframes(_state, times, count);
+            return times;
+        }
+
+        /// <summary>
+        /// Gets a value that indicates whether every keyframe of the current media has been indexed
+        /// </summary>
+        public bool KeyframeIndexComplete
+        {
+            get { return (_stream != null) ? GetKeyframeIndexComplete(_state) : false; }
+        }
+
+        /// <summary>
+        /// Gets the time, in seconds, decoded forward from the preceding keyframe by the last seek
+        /// </summary>
+        public double SeekCost
+        {
+            get { return (_stream != null) ? GetSeekCost(_state) : 0; }
+        }
+
         public override ImageSource TextureSource
         {
             get { return _textureSource; }
@@ -177,17 +569,22 @@ namespace NoesisApp
 
             uint width = Width;
             uint height = Height;
-            if (_renderTarget == null/* ||
-                _renderTarget.Texture.Width != width ||
-                _renderTarget.Texture.Height != height*/)
+            if (_renderTarget == null)
             {
-                _renderTarget = device.CreateRenderTarget("MediaPlayer", width, height, 1, false);
+                _renderTarget = GetRenderTarget(device, width, height);
             }
 
             if (_stream != null)
             {
                 if (HasNewFrame(_state))
                 {
+                    // The size follows the frame about to be drawn, until then the last frame
+                    // keeps showing at its own size
+                    if (_renderTarget.Texture.Width != width || _renderTarget.Texture.Height != height)
+                    {
+                        _renderTarget = GetRenderTarget(device, width, height);
+                    }
+
                     Tile tile = new Tile();
                     tile.X = 0;
                     tile.Y = 0;
@@ -206,14 +603,75 @@ namespace NoesisApp
             return _renderTarget.Texture;
         }
 
+        /// <summary>
+        /// Reuses a render target of the same size, so streams switching between a few
+        /// resolutions don't reallocate. The least recently used one is dropped when full
+        /// </summary>
+        private RenderTarget GetRenderTarget(RenderDevice device, uint width, uint height)
+        {
+            RenderTarget renderTarget = null;
+            foreach (RenderTarget pooled in _renderTargets)
+            {
+                if (pooled.Texture.Width == width && pooled.Texture.Height == height)
+                {
+                    renderTarget = pooled;
+                    break;
+                }
+            }
+
+            if (renderTarget != null)
+            {
+                _renderTargets.Remove(renderTarget);
+            }
+            else
+            {
+                if (_renderTargets.Count == MaxRenderTargets)
+                {
+                    _renderTargets.RemoveAt(0);
+                }
+                renderTarget = device.CreateRenderTarget("MediaPlayer", width, height, 1, false);
+            }
+
+            _renderTargets.Add(renderTarget);
+            return renderTarget;
+        }
+
+        /// <summary>
+        /// Tells the texture source about a new video size, the image keeps its texture source
+        /// </summary>
+        private void UpdateTextureSize()
+        {
+            uint width = Width;
+            uint height = Height;
+            if (_textureSource != null && (width != _textureWidth || height != _textureHeight))
+            {
+                _textureSource.Resize(width, height);
+                _textureWidth = width;
+                _textureHeight = height;
+            }
+        }
+
         private void OnRendering(object sender, Noesis.EventArgs e)
         {
-            if (_stream != null) Update(_state);
+            if (_stream != null)
+            {
+                Update(_state);
+                UpdateTextureSize();
+            }
+        }
+
+        private void OnIsVisibleChanged(object sender, DependencyPropertyChangedEventArgs e)
+        {
+            if (_stream != null) SetIsVisible(_state, (bool)e.NewValue);
         }
 
         private IntPtr _state;
         private DynamicTextureSource _textureSource;
+        private uint _textureWidth;
+        private uint _textureHeight;
         private RenderTarget _renderTarget;
+        private const int MaxRenderTargets = 3;
+        private List<RenderTarget> _renderTargets = new List<RenderTarget>(); // Most recently used last
         private Stream _stream;
         private GCHandle _streamHandle;
         private GCHandle _readFnHandle;
@@ -221,9 +679,77 @@ namespace NoesisApp
         private GCHandle _mediaOpenedFnHandle;
         private GCHandle _mediaEndedFnHandle;
         private GCHandle _mediaFailedFnHandle;
+        private List<GCHandle> _queuedHandles = new List<GCHandle>();
+        private uint _firstQueued = 1; // Native index of the first queued stream still open
+        private SharedStream _sharedStream;
 
         private delegate uint StreamReadDelegate(IntPtr streamPtr, IntPtr buffer, uint size);
 
+        /// <summary>
+        /// Stream a shared decoder reads, kept open while any of its members is
+        /// </summary>
+        private class SharedStream
+        {
+            public Stream Stream;
+            public GCHandle Handle;
+            public int Count;
+        }
+
+        /// <summary>
+        /// The native side decides whether the key joins an existing decoder or opens a new one,
+        /// for example when the existing one failed or is full. The stream opened for this player
+        /// is kept only for a new decoder, otherwise it is closed and the decoder's stream is used
+        /// </summary>
+        private SharedStream OpenSharedStream(string sharingKey, Uri uri, long streamSize,
+            MediaOpenedDelegate mediaOpenedFn, MediaEndedDelegate mediaEndedFn, MediaFailedDelegate mediaFailedFn)
+        {
+            lock (_sharedStreams)
+            {
+                GCHandle handle = GCHandle.Alloc(_stream);
+                OpenSharedMedia(_state, sharingKey, GCHandle.ToIntPtr(handle), uri.GetPath(), streamSize,
+                    _sharedReadFn, _sharedSeekFn, mediaOpenedFn, mediaEndedFn, mediaFailedFn);
+
+                SharedStream shared;
+                if (_sharedStreams.TryGetValue(GetSharedStream(_state), out shared))
+                {
+                    handle.Free();
+                    _stream.Close();
+                    _stream = shared.Stream;
+                }
+                else
+                {
+                    shared = new SharedStream();
+                    shared.Stream = _stream;
+                    shared.Handle = handle;
+                    _sharedStreams.Add(GCHandle.ToIntPtr(handle), shared);
+                }
+
+                shared.Count++;
+                return shared;
+            }
+        }
+
+        private static void ReleaseSharedStream(SharedStream shared)
+        {
+            lock (_sharedStreams)
+            {
+                if (--shared.Count == 0)
+                {
+                    _sharedStreams.Remove(GCHandle.ToIntPtr(shared.Handle));
+                    shared.Handle.Free();
+                    shared.Stream.Close();
+                }
+            }
+        }
+
+        // Keyed by the stream handle each shared decoder was opened with
+        private static Dictionary<IntPtr, SharedStream> _sharedStreams = new Dictionary<IntPtr, SharedStream>();
+
+        // A shared decoder reads through the functions of whichever player opened it, so they
+        // have to outlive every player
+        private static StreamReadDelegate _sharedReadFn = new StreamReadDelegate(StreamRead);
+        private static StreamSeekDelegate _sharedSeekFn = new StreamSeekDelegate(StreamSeek);
+
         private static uint StreamRead(IntPtr streamPtr, IntPtr buffer, uint size)
         {
             try
@@ -269,7 +795,29 @@ namespace NoesisApp
 
         private void OnMediaOpened()
         {
-            _textureSource = new DynamicTextureSource(Width, Height, TextureRender, this);
+            // Queued items of another size only resize the existing texture source
+            if (_textureSource == null)
+            {
+                _textureWidth = Width;
+                _textureHeight = Height;
+                _textureSource = new DynamicTextureSource(_textureWidth, _textureHeight, TextureRender, this);
+            }
+            else
+            {
+                UpdateTextureSize();
+            }
+
+            // Queued streams the player has switched past are not read again
+            uint current = GetCurrentStream(_state);
+            while (_queuedHandles.Count > 0 && _firstQueued < current)
+            {
+                GCHandle handle = _queuedHandles[0];
+                ((Stream)handle.Target).Close();
+                handle.Free();
+                _queuedHandles.RemoveAt(0);
+                _firstQueued++;
+            }
+
             RaiseMediaOpened();
         }
 
@@ -290,22 +838,57 @@ namespace NoesisApp
         [DllImport("MediaPlayer")]
         private static extern void InitMediaPlayer();
 
+        [DllImport("MediaPlayer")]
+        private static extern void ShutdownMediaPlayer();
+
         [DllImport("MediaPlayer")]
         private static extern IntPtr CreateState();
 
         [DllImport("MediaPlayer")]
         private static extern void DestroyState(IntPtr state);
 
+        [DllImport("MediaPlayer")]
+        private static extern void SetCpuAffinity(IntPtr state, ulong cpuMask);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetSchedulingPolicy(IntPtr state, int policy);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetSchedulingPriority(IntPtr state, int priority);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetEventPump(IntPtr state, bool eventPump);
+
+        [DllImport("MediaPlayer", EntryPoint = "WaitForEvents")]
+        private static extern bool NativeWaitForEvents(uint timeoutMs);
+
         [DllImport("MediaPlayer")]
         private static extern void OpenMedia(IntPtr state, IntPtr streamPtr, string streamName, long streamSize,
             StreamReadDelegate readFn, StreamSeekDelegate seekFn, MediaOpenedDelegate mediaOpenedFn, MediaEndedDelegate mediaEndedFn, MediaFailedDelegate mediaFailedFn);
 
+        [DllImport("MediaPlayer")]
+        private static extern bool OpenSharedMedia(IntPtr state, string sharingKey, IntPtr streamPtr, string streamName,
+            long streamSize, StreamReadDelegate readFn, StreamSeekDelegate seekFn, MediaOpenedDelegate mediaOpenedFn,
+            MediaEndedDelegate mediaEndedFn, MediaFailedDelegate mediaFailedFn);
+
+        [DllImport("MediaPlayer")]
+        private static extern IntPtr GetSharedStream(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool QueueMedia(IntPtr state, IntPtr streamPtr, long streamSize);
+
+        [DllImport("MediaPlayer")]
+        private static extern uint GetCurrentStream(IntPtr state);
+
         [DllImport("MediaPlayer")]
         private static extern uint GetWidth(IntPtr state);
 
         [DllImport("MediaPlayer")]
         private static extern uint GetHeight(IntPtr state);
 
+        [DllImport("MediaPlayer")]
+        private static extern void SetCropRect(IntPtr state, uint x, uint y, uint width, uint height);
+
         [DllImport("MediaPlayer")]
         private static extern bool GetCanPause(IntPtr state);
 
@@ -318,6 +901,15 @@ namespace NoesisApp
         [DllImport("MediaPlayer")]
         private static extern float GetBufferingProgress(IntPtr state);
 
+        [DllImport("MediaPlayer")]
+        private static extern bool GetIsLive(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern double GetLatencyTarget(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetLatencyTarget(IntPtr state, double latencyTarget);
+
         [DllImport("MediaPlayer")]
         private static extern float GetDownloadProgress(IntPtr state);
 
@@ -327,6 +919,15 @@ namespace NoesisApp
         [DllImport("MediaPlayer")]
         private static extern double GetTime(IntPtr state);
 
+        [DllImport("MediaPlayer")]
+        private static extern uint GetKeyframes(IntPtr state, [Out] double[] times, uint maxCount);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetKeyframeIndexComplete(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern double GetSeekCost(IntPtr state);
+
         [DllImport("MediaPlayer")]
         private static extern float GetSpeedRatio(IntPtr state);
 
@@ -357,6 +958,27 @@ namespace NoesisApp
         [DllImport("MediaPlayer")]
         private static extern void SetScrubbingEnabled(IntPtr state, bool scrubbingEnabled);
 
+        [DllImport("MediaPlayer")]
+        private static extern bool GetIsLooping(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetIsLooping(IntPtr state, bool isLooping);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetAdaptiveQuality(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetAdaptiveQuality(IntPtr state, bool adaptiveQuality);
+
+        [DllImport("MediaPlayer")]
+        private static extern float GetMaxFrameRate(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetMaxFrameRate(IntPtr state, float maxFrameRate);
+
+        [DllImport("MediaPlayer")]
+        private static extern uint GetQualityLevel(IntPtr state);
+
         [DllImport("MediaPlayer")]
         private static extern void Play(IntPtr state);
 
@@ -369,6 +991,79 @@ namespace NoesisApp
         [DllImport("MediaPlayer")]
         private static extern void Stop(IntPtr state);
 
+        [DllImport("MediaPlayer")]
+        private static extern ulong GetVideoMemoryBudget();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetVideoMemoryBudget(ulong budget);
+
+        [DllImport("MediaPlayer")]
+        private static extern ulong GetVideoMemoryUsage();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetIsVisible(IntPtr state, bool isVisible);
+
+        [DllImport("MediaPlayer")]
+        private static extern uint GetSyncGroup(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetSyncGroup(IntPtr state, uint group);
+
+        [DllImport("MediaPlayer", EntryPoint = "GroupPlay")]
+        private static extern void NativeGroupPlay(uint group);
+
+        [DllImport("MediaPlayer", EntryPoint = "GroupPause")]
+        private static extern void NativeGroupPause(uint group);
+
+        [DllImport("MediaPlayer", EntryPoint = "GroupSeek")]
+        private static extern void NativeGroupSeek(uint group, double position);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetIsSuspended(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern double GetFrameCacheDuration();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetFrameCacheDuration(double duration);
+
+        [DllImport("MediaPlayer")]
+        private static extern ulong GetFrameCacheSize();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetFrameCacheSize(ulong size);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetIsFrameCached(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetImportThread();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetImportThread(bool importThread);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetIoScheduler();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetIoScheduler(bool ioScheduler);
+
+        [DllImport("MediaPlayer")]
+        private static extern uint GetIoBlockSize();
+
+        [DllImport("MediaPlayer")]
+        private static extern void SetIoBlockSize(uint blockSize);
+
+        [DllImport("MediaPlayer")]
+        private static extern double GetReadRate(IntPtr state);
+
+        [DllImport("MediaPlayer")]
+        private static extern void RequestReadback(IntPtr state, uint width, uint height, uint format);
+
+        [DllImport("MediaPlayer")]
+        private static extern bool GetReadback(IntPtr state, byte[] pixels, uint size, out uint width,
+            out uint height, out uint format, out double time);
+
         [DllImport("MediaPlayer")]
         private static extern bool HasNewFrame(IntPtr state);
 